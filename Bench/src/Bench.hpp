@@ -0,0 +1,68 @@
+/*
+ * File:   Bench.hpp
+ * Author: stels
+ *
+ * Created on December 2, 2013, 7:40 PM
+ */
+
+#ifndef BENCH_HPP
+#define	BENCH_HPP
+
+#include <cstdlib>
+#include <chrono>
+#include <iostream>
+#include <string>
+
+// Every benchmark writes one ';' separated line per measurement:
+// bench;variant;threads;ops;seconds;ops_per_sec
+class BenchReport {
+public:
+
+    explicit BenchReport(std::ostream& os) : os(os) {
+    }
+
+    static void header(std::ostream& os) {
+        os << "bench;variant;threads;ops;seconds;ops_per_sec" << std::endl;
+    }
+
+    void add(const std::string& bench, const std::string& variant, size_t threads, size_t ops, double seconds) {
+        os << bench << ";" << variant << ";" << threads << ";" << ops << ";"
+                << seconds << ";" << (seconds > 0 ? ops / seconds : 0) << std::endl;
+    }
+
+private:
+    std::ostream& os;
+};
+
+class Stopwatch {
+public:
+
+    Stopwatch() : start(std::chrono::steady_clock::now()) {
+    }
+
+    double seconds() const {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+private:
+    std::chrono::steady_clock::time_point start;
+};
+
+// Keeps a result alive so the work producing it isn't optimized away.
+// Single threaded, threads sum up their own results first.
+extern volatile size_t benchSink;
+
+template <typename T>
+inline void sink(const T& value) {
+    benchSink = benchSink + static_cast<size_t> (value);
+}
+
+void logBench(BenchReport& report, size_t maxThreads);
+
+// Message construction, header codec and request body parsing
+void protocolBench(BenchReport& report);
+
+// Room history under contention and the server's user list
+void serverBench(BenchReport& report, size_t maxThreads);
+
+#endif	/* BENCH_HPP */
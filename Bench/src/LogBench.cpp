@@ -0,0 +1,137 @@
+/*
+ * File:   LogBench.cpp
+ * Author: stels
+ *
+ * Created on December 2, 2013, 7:52 PM
+ */
+
+#include <atomic>
+#include <vector>
+#include <string>
+
+#include <boost/thread.hpp>
+
+#include "../../Server/include/MessageLog.hpp"
+#include "Bench.hpp"
+
+namespace {
+
+const std::string LINE("\033[1;31;40mspamer42: \033[0mthe quick brown fox jumps over the lazy dog");
+
+// Every 10th operation is a send, the rest are fetches, roughly what a room
+// full of polling clients does.
+const size_t SEND_RATIO = 10;
+const size_t OPS_PER_THREAD = 200000;
+
+// The history as Server kept it before MessageLog
+class LockedLog {
+public:
+
+    void append(const std::string& msg) {
+        boost::recursive_mutex::scoped_lock lock(mutex);
+        messages.push_back(msg);
+    }
+
+    std::string get(size_t index) {
+        boost::recursive_mutex::scoped_lock lock(mutex);
+        return messages[index];
+    }
+
+    size_t size() {
+        boost::recursive_mutex::scoped_lock lock(mutex);
+        return messages.size();
+    }
+
+private:
+    std::vector<std::string> messages;
+    boost::recursive_mutex mutex;
+};
+
+class LockFreeLog {
+public:
+
+    void append(const std::string& msg) {
+        messages.append(msg);
+    }
+
+    std::string get(size_t index) {
+        std::string msg;
+        messages.get(index, msg);
+        return msg;
+    }
+
+    size_t size() {
+        return messages.size();
+    }
+
+private:
+    MessageLog<std::string> messages;
+};
+
+template <typename Log>
+double run(size_t threadsNum) {
+    Log log;
+    log.append(LINE);
+    std::atomic<bool> go(false);
+    boost::thread_group threads;
+    for (size_t t = 0; t < threadsNum; ++t) {
+        threads.create_thread([&log, &go, t]() {
+            while (!go.load()) {
+            }
+            size_t seed = t + 1;
+            for (size_t i = 0; i < OPS_PER_THREAD; ++i) {
+                if (i % SEND_RATIO == 0) {
+                    log.append(LINE);
+                } else {
+                    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+                    std::string msg = log.get((seed >> 33) % log.size());
+                }
+            }
+        });
+    }
+    Stopwatch watch;
+    go.store(true);
+    threads.join_all();
+    return watch.seconds();
+}
+
+// Appends only, batch messages at a time, as a relay posting
+// send_batch_requests does
+double appendOnly(size_t threadsNum, size_t batch) {
+    MessageLog<std::string> log;
+    std::atomic<bool> go(false);
+    boost::thread_group threads;
+    for (size_t t = 0; t < threadsNum; ++t) {
+        threads.create_thread([&log, &go, batch]() {
+            std::vector<std::string> lines(batch, LINE);
+            while (!go.load()) {
+            }
+            for (size_t i = 0; i < OPS_PER_THREAD; i += batch) {
+                if (batch == 1) {
+                    log.append(LINE, LINE.size());
+                } else {
+                    log.appendBatch(lines, [](const std::string & line) {
+                        return line.size();
+                    });
+                }
+            }
+        });
+    }
+    Stopwatch watch;
+    go.store(true);
+    threads.join_all();
+    return watch.seconds();
+}
+
+}
+
+void logBench(BenchReport& report, size_t maxThreads) {
+    for (size_t threads = 1; threads <= maxThreads; threads *= 2) {
+        report.add("log_mixed", "locked_vector", threads, threads * OPS_PER_THREAD, run<LockedLog>(threads));
+        report.add("log_mixed", "message_log", threads, threads * OPS_PER_THREAD, run<LockFreeLog>(threads));
+    }
+    for (size_t threads = 1; threads <= maxThreads; threads *= 2) {
+        report.add("log_append", "single", threads, threads * OPS_PER_THREAD, appendOnly(threads, 1));
+        report.add("log_append", "batch_32", threads, threads * OPS_PER_THREAD, appendOnly(threads, 32));
+    }
+}
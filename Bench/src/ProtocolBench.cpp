@@ -0,0 +1,168 @@
+/*
+ * File:   ProtocolBench.cpp
+ * Author: stels
+ *
+ * Created on December 19, 2013, 5:20 PM
+ */
+
+#include <sstream>
+#include <string>
+
+#include "../../Core/Message.hpp"
+#include "Bench.hpp"
+
+namespace {
+
+const std::string LINE("the quick brown fox jumps over the lazy dog");
+const size_t OPS = 2000000;
+
+double construct() {
+    Stopwatch watch;
+    for (size_t i = 0; i < OPS; ++i) {
+        Message m(Message::send_request);
+        sink(m.getData()[4]);
+    }
+    return watch.seconds();
+}
+
+double copy() {
+    Message m(Message::send_request);
+    Stopwatch watch;
+    for (size_t i = 0; i < OPS; ++i) {
+        Message c(m);
+        sink(c.getData()[4]);
+    }
+    return watch.seconds();
+}
+
+double fillBody() {
+    Message m(Message::send_request);
+    Stopwatch watch;
+    for (size_t i = 0; i < OPS; ++i) {
+        m.fillBody(LINE);
+        sink(m.getBody()[0]);
+    }
+    return watch.seconds();
+}
+
+double encode() {
+    Message m(Message::send_request);
+    Stopwatch watch;
+    for (size_t i = 0; i < OPS; ++i) {
+        m.setvP(Message::VERSION);
+        m.setMsgType(Message::send_request);
+        m.setFlags(0);
+        m.setBodyLength(i & 0xFFF);
+        m.setCorrID(i);
+        sink(m.getData()[19]);
+    }
+    return watch.seconds();
+}
+
+double decode() {
+    Message m = Message::sendRequest(LINE);
+    Stopwatch watch;
+    for (size_t i = 0; i < OPS; ++i) {
+        m.getData()[19] = static_cast<char> (i);
+        sink(m.verifyHeader() + m.getvP() + m.getMsgType() + m.getFlags() + m.getBodyLength() + m.getCorrID());
+    }
+    return watch.seconds();
+}
+
+// Handlers used to parse text bodies through istringstream, they now read
+// binary fields through Codec views. Both are kept to compare.
+Message textRequest(u_int32_t type, const std::string& body) {
+    Message msg(type);
+    msg.fillBody(body);
+    return msg;
+}
+
+double parseFetchStream() {
+    const Message FETCH = textRequest(Message::fetch_request, "123456");
+    Stopwatch watch;
+    for (size_t i = 0; i < OPS; ++i) {
+        std::istringstream iss(std::string(FETCH.getBody(), FETCH.getBodyLength()));
+        u_int32_t state;
+        iss >> state;
+        sink(state);
+    }
+    return watch.seconds();
+}
+
+double parseFetchCodec() {
+    const Message FETCH = Message::fetchRequest(123456);
+    Stopwatch watch;
+    for (size_t i = 0; i < OPS; ++i) {
+        u_int32_t state = 0;
+        Codec::Reader(FETCH.getBodyView()).u32(state);
+        sink(state);
+    }
+    return watch.seconds();
+}
+
+double parseFetchRangeStream() {
+    const Message FETCH_RANGE = textRequest(Message::fetch_range_request, "123456 100 4096");
+    Stopwatch watch;
+    for (size_t i = 0; i < OPS; ++i) {
+        std::istringstream iss(std::string(FETCH_RANGE.getBody(), FETCH_RANGE.getBodyLength()));
+        u_int32_t state = 0;
+        u_int32_t maxCount = 0;
+        u_int32_t maxBytes = Message::MAX_LENGTH;
+        iss >> state >> maxCount >> maxBytes;
+        sink(state + maxCount + maxBytes);
+    }
+    return watch.seconds();
+}
+
+double parseFetchRangeCodec() {
+    const Message FETCH_RANGE = Message::fetchRangeRequest(123456, 100);
+    Stopwatch watch;
+    for (size_t i = 0; i < OPS; ++i) {
+        Codec::Reader reader(FETCH_RANGE.getBodyView());
+        u_int32_t state = 0;
+        u_int32_t maxCount = 0;
+        u_int32_t maxBytes = Message::MAX_LENGTH;
+        reader.u32(state);
+        reader.u32(maxCount);
+        reader.u32(maxBytes);
+        sink(state + maxCount + maxBytes);
+    }
+    return watch.seconds();
+}
+
+double parseSendStream() {
+    const Message SEND = Message::sendRequest(LINE);
+    Stopwatch watch;
+    for (size_t i = 0; i < OPS; ++i) {
+        std::istringstream iss(std::string(SEND.getBody(), SEND.getBodyLength()));
+        std::string msg;
+        std::getline(iss, msg);
+        sink(msg.size());
+    }
+    return watch.seconds();
+}
+
+double parseSendCodec() {
+    const Message SEND = Message::sendRequest(LINE);
+    Stopwatch watch;
+    for (size_t i = 0; i < OPS; ++i) {
+        sink(Codec::Reader(SEND.getBodyView()).line().size());
+    }
+    return watch.seconds();
+}
+
+}
+
+void protocolBench(BenchReport& report) {
+    report.add("message", "construct", 1, OPS, construct());
+    report.add("message", "copy", 1, OPS, copy());
+    report.add("message", "fill_body", 1, OPS, fillBody());
+    report.add("message", "encode", 1, OPS, encode());
+    report.add("message", "decode", 1, OPS, decode());
+    report.add("parse_fetch", "istringstream", 1, OPS, parseFetchStream());
+    report.add("parse_fetch", "codec", 1, OPS, parseFetchCodec());
+    report.add("parse_fetch_range", "istringstream", 1, OPS, parseFetchRangeStream());
+    report.add("parse_fetch_range", "codec", 1, OPS, parseFetchRangeCodec());
+    report.add("parse_send", "istringstream", 1, OPS, parseSendStream());
+    report.add("parse_send", "codec", 1, OPS, parseSendCodec());
+}
@@ -0,0 +1,176 @@
+/*
+ * File:   ServerBench.cpp
+ * Author: stels
+ *
+ * Created on December 19, 2013, 5:20 PM
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+#include "../../Server/include/Server.hpp"
+#include "Bench.hpp"
+
+namespace {
+
+const std::string LINE("\033[1;31;40mspamer42: \033[0mthe quick brown fox jumps over the lazy dog");
+
+// Same mix as log_mixed: every 10th operation is a send
+const size_t SEND_RATIO = 10;
+const size_t OPS_PER_THREAD = 100000;
+
+double roomMixed(size_t threadsNum) {
+    Room room("bench", 1 << 20, 256 << 20);
+    room.addMessage(LINE);
+    std::atomic<bool> go(false);
+    std::atomic<size_t> read(0);
+    boost::thread_group threads;
+    for (size_t t = 0; t < threadsNum; ++t) {
+        threads.create_thread([&room, &go, &read, t]() {
+            while (!go.load()) {
+            }
+            size_t seed = t + 1;
+            size_t bytes = 0;
+            for (size_t i = 0; i < OPS_PER_THREAD; ++i) {
+                if (i % SEND_RATIO == 0) {
+                    room.addMessage(LINE);
+                } else {
+                    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+                    Message msg;
+                    room.getMessage((seed >> 33) % room.getMessagesSize(), msg);
+                    bytes += msg.getBodyLength();
+                }
+            }
+            read += bytes;
+        });
+    }
+    Stopwatch watch;
+    go.store(true);
+    threads.join_all();
+    sink(read.load());
+    return watch.seconds();
+}
+
+// Server::startConnection and stopConnection with a thread per shard,
+// each registering its own connections like the shard's io thread does
+void users(BenchReport& report, size_t count, size_t threadsNum) {
+    io_service service;
+    std::vector<std::vector<Server::Ptr> > connections(threadsNum);
+    for (size_t i = 0; i < count; ++i) {
+        connections[i % threadsNum].push_back(Connection::createNewUser(service, i % threadsNum));
+    }
+    // Connections go away in no particular order
+    std::mt19937 random(42);
+    for (auto& shard : connections) {
+        std::shuffle(shard.begin(), shard.end(), random);
+    }
+    auto run = [&connections, threadsNum](void (*f)(const Server::Ptr&)) -> double {
+        std::atomic<bool> go(false);
+        boost::thread_group threads;
+        for (size_t t = 0; t < threadsNum; ++t) {
+            threads.create_thread([&connections, &go, f, t]() {
+                while (!go.load()) {
+                }
+                for (const Server::Ptr& p : connections[t]) {
+                    f(p);
+                }
+            });
+        }
+        Stopwatch watch;
+        go.store(true);
+        threads.join_all();
+        return watch.seconds();
+    };
+    const std::string name = std::to_string(count);
+    report.add("users_start_" + name, "server", threadsNum, count, run(&Server::startConnection));
+    sink(Server::getConnectionCount());
+    report.add("users_stop_" + name, "server", threadsNum, count, run(&Server::stopConnection));
+}
+
+const size_t IDLE_TICKS = 120;
+// The size of a shard's wheel
+const size_t WHEEL_SLOTS = 256;
+
+// Re-arming the idle timeout of every connection once with a deadline_timer
+// each, then count started connections in a Connection::Timers armed and
+// swept the way Connection::armTimeouts and the shard's ticker do it
+void timers(BenchReport& report, size_t count) {
+    const std::string name = std::to_string(count);
+    {
+        io_service service;
+        std::vector<boost::shared_ptr<deadline_timer> > perConnection;
+        for (size_t i = 0; i < count; ++i) {
+            perConnection.push_back(boost::make_shared<deadline_timer>(service));
+            perConnection.back()->expires_from_now(boost::posix_time::seconds(IDLE_TICKS));
+            perConnection.back()->async_wait([](const boost::system::error_code&) {
+            });
+        }
+        Stopwatch rearm;
+        for (const auto& t : perConnection) {
+            // Cancels the pending wait, its handler still has to run
+            t->expires_from_now(boost::posix_time::seconds(IDLE_TICKS));
+            t->async_wait([](const boost::system::error_code&) {
+            });
+        }
+        report.add("timers_rearm_" + name, "deadline_timer", 1, count, rearm.seconds());
+        for (const auto& t : perConnection) {
+            t->cancel();
+        }
+        service.run();
+    }
+    io_service service;
+    std::vector<Server::Ptr> connections;
+    for (size_t i = 0; i < count; ++i) {
+        connections.push_back(Connection::createNewUser(service));
+        // service never runs, the read start() begins stays queued
+        connections.back()->start();
+    }
+    Connection::Timers wheel(WHEEL_SLOTS);
+    Stopwatch schedule;
+    for (const Server::Ptr& p : connections) {
+        wheel.schedule(p, p->checkTimeouts(wheel.getNow()));
+    }
+    report.add("timers_schedule_" + name, "wheel", 1, count, schedule.seconds());
+    // Nothing is read or written, every connection comes due once on its
+    // write deadline and checkTimeouts re-arms it for its idle one
+    Stopwatch sweep;
+    for (size_t tick = 0; tick < IDLE_TICKS; ++tick) {
+        Connection::Timers::Tick now = wheel.getNow() + 1;
+        wheel.advance([now](const boost::weak_ptr<Connection>& c) {
+            Server::Ptr p = c.lock();
+            return p ? p->checkTimeouts(now) : 0;
+        });
+    }
+    sink(wheel.size());
+    report.add("timers_sweep_" + name, "wheel", 1, count, sweep.seconds());
+    for (const Server::Ptr& p : connections) {
+        Server::stopConnection(p);
+    }
+}
+
+}
+
+void serverBench(BenchReport& report, size_t maxThreads) {
+    // addMessage logs every line like the server does, to nowhere
+    std::ofstream devnull("/dev/null");
+    Logger::start(Logger::Config(), devnull);
+    for (size_t threads = 1; threads <= maxThreads; threads *= 2) {
+        report.add("room_mixed", "room", threads, threads * OPS_PER_THREAD, roomMixed(threads));
+    }
+    Logger::stop();
+    Server::addShards(maxThreads);
+    for (size_t count : {1000, 10000, 50000}) {
+        for (size_t threads = 1; threads <= maxThreads; threads *= 2) {
+            users(report, count, threads);
+        }
+    }
+    for (size_t count : {10000, 100000}) {
+        timers(report, count);
+    }
+}
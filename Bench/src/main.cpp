@@ -0,0 +1,51 @@
+/*
+ * File:   main.cpp
+ * Author: stels
+ *
+ * Created on December 2, 2013, 7:40 PM
+ */
+
+#include <iostream>
+#include <cctype>
+#include <cstring>
+#include <thread>
+
+#include "Bench.hpp"
+
+volatile size_t benchSink = 0;
+
+// Runs the named suites, all of them when none is given:
+// bench [maxThreads] [log] [protocol] [server]
+int main(int argc, char** argv) {
+    size_t maxThreads = std::thread::hardware_concurrency();
+    int first = 1;
+    if (argc > 1 && std::isdigit(argv[1][0])) {
+        maxThreads = std::strtoul(argv[1], nullptr, 10);
+        first = 2;
+    }
+    if (maxThreads == 0) {
+        maxThreads = 1;
+    }
+    auto wanted = [argc, argv, first](const char* suite) {
+        if (argc <= first) {
+            return true;
+        }
+        for (int i = first; i < argc; ++i) {
+            if (std::strcmp(argv[i], suite) == 0) {
+                return true;
+            }
+        }
+        return false;
+    };
+    BenchReport::header(std::cout);
+    BenchReport report(std::cout);
+    if (wanted("log")) {
+        logBench(report, maxThreads);
+    }
+    if (wanted("protocol")) {
+        protocolBench(report);
+    }
+    if (wanted("server")) {
+        serverBench(report, maxThreads);
+    }
+}
@@ -11,16 +11,19 @@
 #include <unordered_map>
 #include <iostream>
 #include <sstream>
+#include <fstream>
+#include <memory>
 #include <deque>
 #include <thread>
-#include <chrono>
 #include <string>
+#include <algorithm>
 
 #include <boost/asio.hpp>
 #include <boost/system/error_code.hpp>
 
 
 #include "../../Core/Message.hpp"
+#include "../../Core/Compression.hpp"
 
 using boost::asio::ip::tcp;
 
@@ -38,16 +41,46 @@ public:
     writeMessages(),
     username(username),
     msgCount(-1),
+    state(CONNECTING),
+    writeBatch(),
+    writeBuffers(),
+    writing(false),
+    wrote(false),
+    heartbeatTimer(io_service),
+    subscribeTimer(io_service),
+    pollTimer(io_service),
+    pollInterval(POLL_MIN_MS),
+    polling(false),
+    nextCorrID(1),
+    inFlight(),
+    opening(),
+    outgoing(),
+    incoming(),
     handlers({
         {Message::login_reply, &Client::onLogin},
         {Message::fetch_reply, &Client::onFetch},
+        {Message::fetch_range_reply, &Client::onFetchRange},
+        {Message::subscribe_reply, &Client::onSubscribe},
+        {Message::truncated_reply, &Client::onTruncated},
+        {Message::join_reply, &Client::onJoin},
+        {Message::leave_reply, &Client::onSend},
+        {Message::room_send_reply, &Client::onRoomSend},
         {Message::send_reply, &Client::onSend},
-        {Message::logout_reply, &Client::onLogout}
+        {Message::logout_reply, &Client::onLogout},
+        {Message::heartbeat_reply, &Client::onSend},
+        {Message::stream_open_reply, &Client::onStreamOpen},
+        {Message::stream_chunk_reply, &Client::onStreamChunk},
+        {Message::stream_close_reply, &Client::onStreamClose}
     }) {
         doConnect(endpoint_iterator);
     }
 
     void stop() {
+        state = CLOSED;
+        boost::system::error_code ec;
+        heartbeatTimer.cancel(ec);
+        subscribeTimer.cancel(ec);
+        pollTimer.cancel(ec);
         io_service_.stop();
         socket_.close();
     }
@@ -57,44 +90,165 @@ public:
             stop(); });
     }
 
+    // Goes out at once unless a write is in flight, then with the next one
     void postMessage(const Message m) {
         io_service_.post(
                 [this, m]() {
-                    writeMessages.push_front(m);
+                    writeMessages.push_back(m);
+                    doFlush();
+                });
+    }
+
+    // Streams the file to user, chunks go out as the window allows
+    void postFile(const std::string& user, const std::string& path) {
+        io_service_.post(
+                [this, user, path]() {
+                    std::shared_ptr<std::ifstream> file(new std::ifstream(path.c_str(), std::ios::binary));
+                    if (!*file) {
+                        std::cout << "Can't read " << path << std::endl;
+                        return;
+                    }
+                    Upload upload = {file, path, 0, 0};
+                    opening.push_back(upload);
+                    writeMessages.push_back(Message::streamOpenRequest(user, username, path.substr(path.rfind('/') + 1)));
+                    doFlush();
                 });
     }
 
 private:
 
+    // Nothing here ever blocks the io thread. Requests typed before the
+    // login is answered are queued behind it, the server handles them in
+    // order.
+    enum State {
+        CONNECTING,
+        // login_reply gives the state to subscribe from
+        LOGGING_IN,
+        // Servers without push never answer the subscribe
+        SUBSCRIBING,
+        // Lobby messages are pushed
+        SUBSCRIBED,
+        // The lobby is fetched on a timer backing off while it is quiet
+        POLLING,
+        CLOSED
+    };
+
     enum {
-        TIME_OUT = 10
+        // Well under the server's idle timeout
+        HEARTBEAT_SECONDS = 30,
+        SUBSCRIBE_TIMEOUT_MS = 1000,
+        POLL_MIN_MS = 10,
+        POLL_MAX_MS = 1000,
+        POLL_COUNT = 64
     };
     
     void doConnect(tcp::resolver::iterator endpoint_iterator) {
         boost::asio::async_connect(socket_, endpoint_iterator,
                 [this](boost::system::error_code ec, tcp::resolver::iterator) {
                     if (!ec) {
+                        boost::system::error_code ignored;
+                        socket_.set_option(tcp::no_delay(true), ignored);
                         doLogin();
+                        doReadHeader();
                     } else {
                         stop();
                     }
                 });
     }
 
+    // Asks for compressed replies, everything that comes back compressed
+    // is inflated before it is handled
     void doLogin() {
-        Message msg(Message::login_request);
+        Message msg(Message::login_request, Message::VERSION, Message::COMPRESSED);
         msg.fillBody(username);
-        doWrite(msg);
+        state = LOGGING_IN;
+        writeMessages.push_front(msg);
+        doFlush();
+    }
+
+    void doSubscribe() {
+        state = SUBSCRIBING;
+        writeMessages.push_back(Message::subscribeRequest(msgCount));
+        doFlush();
+        subscribeTimer.expires_from_now(boost::posix_time::milliseconds(static_cast<long> (SUBSCRIBE_TIMEOUT_MS)));
+        subscribeTimer.async_wait([this](boost::system::error_code ec) {
+            if (ec || state != SUBSCRIBING) {
+                return;
+            }
+            // A late subscribe_reply still switches to push
+            state = POLLING;
+            doPoll();
+        });
+    }
+
+    void doPoll() {
+        polling = true;
+        writeMessages.push_back(Message::fetchRangeRequest(msgCount, POLL_COUNT));
+        doFlush();
+    }
+
+    // Polls again at once while there is news, otherwise waits twice as
+    // long as last time
+    void onPolled(bool news) {
+        polling = false;
+        if (news) {
+            pollInterval = POLL_MIN_MS;
+            doPoll();
+            return;
+        }
+        schedulePoll();
+        pollInterval = std::min(pollInterval * 2, static_cast<long> (POLL_MAX_MS));
+    }
+
+    void schedulePoll() {
+        pollTimer.expires_from_now(boost::posix_time::milliseconds(pollInterval));
+        pollTimer.async_wait([this](boost::system::error_code ec) {
+            if (ec || state != POLLING || polling) {
+                return;
+            }
+            doPoll();
+        });
     }
 
-    void doWrite(const Message m) {
-//        std::cout << "Do write" << std::endl;
-        boost::asio::async_write(socket_,
-                boost::asio::buffer(m.getData(), m.getDataLength()),
-                [this](boost::system::error_code ec, std::size_t sz/*length*/) {
-//                    std::cout << "Written " << sz << std::endl;
+    // Something was just sent, there is news soon
+    void pollSoon() {
+        pollInterval = POLL_MIN_MS;
+        if (state == POLLING && !polling) {
+            schedulePoll();
+        }
+    }
+
+    // Tags the request so its reply can be matched, see handleReply
+    void track(Message m) {
+        u_int32_t id = nextCorrID++;
+        if (nextCorrID == 0) {
+            nextCorrID = 1;
+        }
+        m.setCorrID(id);
+        inFlight[id] = m.getMsgType() + 1;
+    }
+
+    // Everything queued goes out in one gathered write, whatever is posted
+    // meanwhile waits for the next
+    void doFlush() {
+        if (state == CONNECTING || state == CLOSED || writing || writeMessages.empty()) {
+            return;
+        }
+        writing = true;
+        wrote = true;
+        writeBatch.assign(writeMessages.begin(), writeMessages.end());
+        writeMessages.clear();
+        writeBuffers.clear();
+        for (const Message& m : writeBatch) {
+            track(m);
+            writeBuffers.push_back(boost::asio::buffer(m.getData(), m.getDataLength()));
+        }
+        boost::asio::async_write(socket_, writeBuffers,
+                [this](boost::system::error_code ec, std::size_t /*length*/) {
                     if (!ec) {
-                        doReadHeader();
+                        writeBatch.clear();
+                        writing = false;
+                        doFlush();
                     } else {
                         stop();
                     }
@@ -108,6 +262,7 @@ private:
                 boost::asio::buffer(readMsg.getData(), Message::HEADER_LENGTH),
                 [this](boost::system::error_code ec, std::size_t /*length*/) {
                     if (!ec && readMsg.verifyHeader()) {
+                        readMsg.reserveBody(readMsg.getBodyLength());
                         doReadBody();
                     } else {
                         stop();
@@ -121,8 +276,17 @@ private:
                 boost::asio::buffer(readMsg.getBody(), readMsg.getBodyLength()),
                 [this](boost::system::error_code ec, std::size_t /*length*/) {
                     if (!ec) {
+                        // On login_reply the flag only confirms compression
+                        if ((readMsg.getFlags() & Message::COMPRESSED) && readMsg.getMsgType() != Message::login_reply
+                                && !Compression::decompress(readMsg)) {
+                            std::cout << "Corrupt reply " << readMsg.getMsgType() << std::endl;
+                            stop();
+                            return;
+                        }
                         handleReply();
-                        doRequest();
+                        if (state != CLOSED) {
+                            doReadHeader();
+                        }
                     } else {
                         stop();
                     }
@@ -130,6 +294,19 @@ private:
     }
 
     void handleReply() {
+        // Pushes carry no corrID, everything else must answer a request
+        // in flight with the matching reply type
+        u_int32_t id = readMsg.getCorrID();
+        if (id != 0) {
+            auto request = inFlight.find(id);
+            if (request == inFlight.end() || (request->second != readMsg.getMsgType()
+                    && readMsg.getMsgType() != Message::truncated_reply)) {
+                std::cout << "Unexpected reply " << readMsg.getMsgType() << " to " << id << std::endl;
+                stop();
+                return;
+            }
+            inFlight.erase(request);
+        }
         auto handler = handlers.find(readMsg.getMsgType());
         if (handler != handlers.end()) {
             (this->*(handler -> second))();
@@ -140,44 +317,212 @@ private:
     }
 
     void onLogin() {
-        std::istringstream ss(std::string(readMsg.getBody(), readMsg.getBodyLength()));
-        ss >> msgCount;
+        u_int32_t state = 0;
+        Codec::Reader(readMsg.getBodyView()).u32(state);
+        msgCount = state;
+        doSubscribe();
+        startHeartbeat();
+    }
+
+    void onSubscribe() {
+        state = SUBSCRIBED;
+        boost::system::error_code ec;
+        subscribeTimer.cancel(ec);
+        pollTimer.cancel(ec);
+    }
+
+    // The server drops connections that stay quiet too long, a heartbeat
+    // goes out when nothing else was written for a while
+    void startHeartbeat() {
+        wrote = false;
+        heartbeatTimer.expires_from_now(boost::posix_time::seconds(static_cast<long> (HEARTBEAT_SECONDS)));
+        heartbeatTimer.async_wait([this](boost::system::error_code ec) {
+            if (ec) {
+                return;
+            }
+            if (!wrote) {
+                writeMessages.push_back(Message::heartbeatRequest());
+                doFlush();
+            }
+            startHeartbeat();
+        });
     }
 
     void onFetch() {
-        std::istringstream iss(std::string(readMsg.getBody(), readMsg.getBodyLength()));
-        std::string msg;
-        std::getline(iss, msg);
+        boost::string_ref msg = Codec::Reader(readMsg.getBodyView()).line();
         if (!msg.empty()) {
             std::cout << std::endl << msg << std::endl;
             ++msgCount;
         }
     }
 
-    void onSend() {
+    void onFetchRange() {
+        Codec::Reader reader(readMsg.getBodyView());
+        u_int32_t state;
+        boost::string_ref name;
+        if (!Message::rangeHead(reader, state, name)) {
+            return;
+        }
+        // Lobby pushes carry the new state only, other rooms add their name
+        std::string room;
+        if (name.empty()) {
+            bool news = static_cast<int> (state) != msgCount;
+            msgCount = state;
+            // Only polls ask for the lobby's range
+            if (readMsg.getCorrID() != 0 && this->state == POLLING) {
+                onPolled(news);
+            }
+        } else {
+            room = "[" + name.to_string() + "] ";
+        }
+        const char* pos = reader.position();
+        const char* end = readMsg.getBody() + readMsg.getBodyLength();
+        u_int32_t type;
+        const char* body;
+        u_int32_t length;
+        while (Message::nextFrame(pos, end, type, body, length)) {
+            if (type == Message::fetch_reply && length > 0) {
+                std::cout << std::endl << room << std::string(body, length) << std::endl;
+            }
+        }
+    }
 
+    // The server no longer has the messages from msgCount on
+    void onTruncated() {
+        Codec::Reader reader(readMsg.getBodyView());
+        u_int32_t state;
+        boost::string_ref room;
+        if (!Message::rangeHead(reader, state, room)) {
+            return;
+        }
+        int resumeAt = state;
+        if (!room.empty()) {
+            std::cout << std::endl << "[" << room << "] missed some messages" << std::endl;
+        } else if (resumeAt > msgCount) {
+            std::cout << std::endl << "... " << resumeAt - msgCount << " messages skipped" << std::endl;
+            msgCount = resumeAt;
+        }
+        if (room.empty() && readMsg.getCorrID() != 0 && this->state == POLLING) {
+            onPolled(true);
+        }
+    }
+
+    void onJoin() {
+        if (readMsg.getBodyLength() == 0) {
+            std::cout << "Bad room name or too many rooms" << std::endl;
+        }
+    }
+
+    void onRoomSend() {
+        if (readMsg.getBodyLength() > 0) {
+            std::cout << std::string(readMsg.getBody(), readMsg.getBodyLength()) << std::endl;
+        }
+    }
+
+    void onSend() {
+        pollSoon();
     }
 
     void onLogout() {
         stop();
     }
 
-    void doRequest() {
-        std::this_thread::sleep_for(std::chrono::milliseconds(TIME_OUT));
-        if (writeMessages.empty()) {
-            doFetch();
-        } else {
-            doWrite(writeMessages.back());
-            writeMessages.pop_back();
+    // Answers our stream_open_request or tells of a stream coming in
+    void onStreamOpen() {
+        Codec::Reader reader(readMsg.getBodyView());
+        u_int32_t id = 0;
+        if (readMsg.getCorrID() != 0) {
+            // Open replies come in the order the requests went out
+            Upload upload = opening.front();
+            opening.pop_front();
+            if (!reader.u32(id) || !reader.u32(upload.window)) {
+                std::cout << "Nobody to send " << upload.path << " to" << std::endl;
+                return;
+            }
+            outgoing[id] = upload;
+            sendChunks(id);
+            return;
+        }
+        boost::string_ref from;
+        if (!reader.u32(id) || !reader.bytes(from)) {
+            return;
         }
+        std::ostringstream name;
+        name << "received-" << id;
+        std::shared_ptr<std::ofstream> file(new std::ofstream(name.str().c_str(), std::ios::binary));
+        incoming[id] = file;
+        std::cout << std::endl << from << " sends " << reader.rest() << " into " << name.str() << std::endl;
     }
 
-    void doFetch() {
-        Message msg(Message::fetch_request);
-        std::ostringstream oss;
-        oss << msgCount;
-        msg.fillBody(oss.str());
-        doWrite(msg);
+    // Keeps up to the window of chunks waiting, closes once the file is
+    // sent and every chunk is answered
+    void sendChunks(u_int32_t id) {
+        Upload& upload = outgoing[id];
+        char chunk[Message::CHUNK_LENGTH];
+        while (upload.waiting < upload.window && *upload.file) {
+            upload.file->read(chunk, sizeof (chunk));
+            if (upload.file->gcount() > 0) {
+                writeMessages.push_back(Message::streamChunkRequest(id, chunk, upload.file->gcount()));
+                ++upload.waiting;
+            }
+        }
+        if (!*upload.file && upload.waiting == 0) {
+            writeMessages.push_back(Message::streamCloseRequest(id));
+            std::cout << "Sent " << upload.path << std::endl;
+            outgoing.erase(id);
+        }
+        doFlush();
+    }
+
+    void onStreamChunk() {
+        Codec::Reader reader(readMsg.getBodyView());
+        u_int32_t id = 0;
+        reader.u32(id);
+        if (readMsg.getCorrID() == 0) {
+            auto in = incoming.find(id);
+            if (in != incoming.end()) {
+                boost::string_ref data = reader.rest();
+                in->second->write(data.data(), data.size());
+            }
+            return;
+        }
+        u_int32_t status = Message::STREAM_ABORTED;
+        reader.u32(status);
+        auto out = outgoing.find(id);
+        if (out == outgoing.end()) {
+            return;
+        }
+        if (status != Message::STREAM_OK) {
+            std::cout << "Sending " << out->second.path << " failed" << std::endl;
+            outgoing.erase(out);
+            return;
+        }
+        --out->second.waiting;
+        sendChunks(id);
+    }
+
+    // Pushed when the other end closed or went away, our own closes are
+    // answered here too
+    void onStreamClose() {
+        if (readMsg.getCorrID() != 0) {
+            return;
+        }
+        Codec::Reader reader(readMsg.getBodyView());
+        u_int32_t id = 0;
+        u_int32_t status = Message::STREAM_ABORTED;
+        reader.u32(id);
+        reader.u32(status);
+        auto in = incoming.find(id);
+        if (in != incoming.end()) {
+            std::cout << std::endl << "received-" << id << (status == Message::STREAM_OK ? " complete" : " incomplete")
+                    << std::endl;
+            incoming.erase(in);
+        }
+        auto out = outgoing.find(id);
+        if (out != outgoing.end()) {
+            std::cout << "Sending " << out->second.path << " failed" << std::endl;
+            outgoing.erase(out);
+        }
     }
 
     boost::asio::io_service& io_service_;
@@ -186,6 +531,39 @@ private:
     MessageQueue writeMessages;
     std::string username;
     int msgCount;
+    State state;
+    // The messages being written and their buffers
+    std::vector<Message> writeBatch;
+    std::vector<boost::asio::const_buffer> writeBuffers;
+    bool writing;
+
+    // Anything written since the heartbeat timer was armed
+    bool wrote;
+    boost::asio::deadline_timer heartbeatTimer;
+    boost::asio::deadline_timer subscribeTimer;
+    boost::asio::deadline_timer pollTimer;
+    long pollInterval;
+    // A poll waits for its reply
+    bool polling;
+
+    // Request corrID -> expected reply type
+    u_int32_t nextCorrID;
+    std::unordered_map<u_int32_t, u_int32_t> inFlight;
+
+    // A file being streamed out
+    struct Upload {
+        std::shared_ptr<std::ifstream> file;
+        std::string path;
+        // Chunks that may wait for their replies and that do
+        u_int32_t window;
+        u_int32_t waiting;
+    };
+
+    // Waiting for stream_open_reply
+    std::deque<Upload> opening;
+    // By stream id
+    std::unordered_map<u_int32_t, Upload> outgoing;
+    std::unordered_map<u_int32_t, std::shared_ptr<std::ofstream> > incoming;
 
     typedef void(Client::*Handler)();
     typedef std::unordered_map<u_int32_t, Handler> TypeHandlerMap;
@@ -210,6 +588,10 @@ int main(int argc, char* argv[]) {
             io_service.run(); });
 
         const static std::string EXIT("exit");
+        const static std::string JOIN("/join");
+        const static std::string LEAVE("/leave");
+        const static std::string TO("/to");
+        const static std::string FILE("/file");
         while (true) {
             std::string msgStr;
             std::getline(std::cin, msgStr);
@@ -217,7 +599,24 @@ int main(int argc, char* argv[]) {
                 c.postMessage(Message::logoutRequest());
                 break;
             }
-            if (msgStr.size() < Message::MAX_LENGTH) {
+            // /join <room>, /leave <room>, /to <room> <message> and
+            // /file <user> <path>, anything else goes to the lobby
+            std::istringstream iss(msgStr);
+            std::string command, room;
+            iss >> command >> room;
+            if (command == JOIN && !room.empty()) {
+                c.postMessage(Message::joinRequest(room));
+            } else if (command == LEAVE && !room.empty()) {
+                c.postMessage(Message::leaveRequest(room));
+            } else if (command == TO && !room.empty()) {
+                std::string text;
+                std::getline(iss >> std::ws, text);
+                c.postMessage(Message::roomSendRequest(room, text));
+            } else if (command == FILE && !room.empty()) {
+                std::string path;
+                std::getline(iss >> std::ws, path);
+                c.postFile(room, path);
+            } else if (msgStr.size() < Message::MAX_LENGTH) {
                 c.postMessage(Message::sendRequest(msgStr));
             }
         }
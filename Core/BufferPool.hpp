@@ -0,0 +1,208 @@
+/*
+ * File:   BufferPool.hpp
+ * Author: stels
+ *
+ * Created on December 5, 2013, 3:21 PM
+ */
+
+#ifndef BUFFERPOOL_HPP
+#define	BUFFERPOOL_HPP
+
+#include <cstdlib>
+#include <atomic>
+#include <new>
+#include <vector>
+#include <algorithm>
+
+#include <boost/thread/mutex.hpp>
+#include <boost/intrusive_ptr.hpp>
+
+class BufferPool;
+
+// Reference counted block of raw bytes, the bytes follow the object itself.
+// Contents are not initialized.
+class Buffer {
+public:
+
+    char* data() {
+        return reinterpret_cast<char*> (this + 1);
+    }
+
+    const char* data() const {
+        return reinterpret_cast<const char*> (this + 1);
+    }
+
+    size_t capacity() const {
+        return capacity_;
+    }
+
+private:
+    friend class BufferPool;
+
+    Buffer(size_t capacity, size_t sizeClass) : refs(0), capacity_(capacity), sizeClass(sizeClass) {
+    }
+
+    friend void intrusive_ptr_add_ref(Buffer* b) {
+        b->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    friend inline void intrusive_ptr_release(Buffer* b);
+
+    std::atomic<size_t> refs;
+    size_t capacity_;
+    size_t sizeClass;
+};
+
+// Buffers come in a few size classes, released ones are kept in a per thread
+// free list and handed out again, so a steady stream of requests doesn't hit
+// the heap at all. Buffers often die on another thread than they were born
+// on, so thread lists trade batches with a shared depot instead of running
+// dry on one thread and overflowing on another. Requests above the largest
+// class go straight to the heap.
+class BufferPool {
+public:
+
+    typedef boost::intrusive_ptr<Buffer> Ptr;
+
+    enum {
+        SIZE_CLASSES = 7,
+        CACHE_LIMIT = 64,
+        BATCH = CACHE_LIMIT / 2
+    };
+
+    static Ptr acquire(size_t size) {
+        acquisitions().fetch_add(1, std::memory_order_relaxed);
+        size_t c = sizeClass(size);
+        if (c < SIZE_CLASSES) {
+            std::vector<Buffer*>& free = cache().free[c];
+            if (free.empty()) {
+                depot().take(c, free);
+            }
+            if (!free.empty()) {
+                Buffer* b = free.back();
+                free.pop_back();
+                return Ptr(b);
+            }
+            size = classSize(c);
+        }
+        heapAllocations().fetch_add(1, std::memory_order_relaxed);
+        void* raw = ::operator new(sizeof (Buffer) + size);
+        return Ptr(new (raw) Buffer(size, c));
+    }
+
+    // Buffers taken from the heap so far, flat in steady state
+    static size_t getHeapAllocations() {
+        return heapAllocations().load(std::memory_order_relaxed);
+    }
+
+    static size_t getAcquisitions() {
+        return acquisitions().load(std::memory_order_relaxed);
+    }
+
+private:
+    friend void intrusive_ptr_release(Buffer* b);
+
+    static size_t classSize(size_t c) {
+        // The largest class holds a full header and MAX_LENGTH body
+        const static size_t SIZES[SIZE_CLASSES] = {64, 128, 256, 512, 1024, 2048, 4116};
+        return SIZES[c];
+    }
+
+    static size_t sizeClass(size_t size) {
+        size_t c = 0;
+        while (c < SIZE_CLASSES && classSize(c) < size) {
+            ++c;
+        }
+        return c;
+    }
+
+    static void release(Buffer* b) {
+        if (b->sizeClass < SIZE_CLASSES && !cacheDestroyed()) {
+            std::vector<Buffer*>& free = cache().free[b->sizeClass];
+            if (free.size() >= CACHE_LIMIT) {
+                depot().give(b->sizeClass, free);
+            }
+            free.push_back(b);
+            return;
+        }
+        destroy(b);
+    }
+
+    static void destroy(Buffer* b) {
+        b->~Buffer();
+        ::operator delete(b);
+    }
+
+    struct Cache {
+
+        ~Cache() {
+            cacheDestroyed() = true;
+            for (size_t c = 0; c < SIZE_CLASSES; ++c) {
+                while (free[c].size() >= BATCH) {
+                    depot().give(c, free[c]);
+                }
+                for (Buffer* b : free[c]) {
+                    destroy(b);
+                }
+            }
+        }
+
+        std::vector<Buffer*> free[SIZE_CLASSES];
+    };
+
+    struct Depot {
+
+        void take(size_t c, std::vector<Buffer*>& to) {
+            boost::mutex::scoped_lock lock(mutex);
+            std::vector<Buffer*>& from = free[c];
+            size_t n = std::min<size_t>(BATCH, from.size());
+            to.insert(to.end(), from.end() - n, from.end());
+            from.resize(from.size() - n);
+        }
+
+        void give(size_t c, std::vector<Buffer*>& from) {
+            boost::mutex::scoped_lock lock(mutex);
+            free[c].insert(free[c].end(), from.end() - BATCH, from.end());
+            from.resize(from.size() - BATCH);
+        }
+
+        boost::mutex mutex;
+        std::vector<Buffer*> free[SIZE_CLASSES];
+    };
+
+    // Never destroyed, buffers may be released during static destruction
+    static Depot& depot() {
+        static Depot* d = new Depot;
+        return *d;
+    }
+
+    static Cache& cache() {
+        static thread_local Cache c;
+        return c;
+    }
+
+    // Buffers released during static destruction outlive the thread's cache
+    static bool& cacheDestroyed() {
+        static thread_local bool destroyed = false;
+        return destroyed;
+    }
+
+    static std::atomic<size_t>& heapAllocations() {
+        static std::atomic<size_t> counter(0);
+        return counter;
+    }
+
+    static std::atomic<size_t>& acquisitions() {
+        static std::atomic<size_t> counter(0);
+        return counter;
+    }
+};
+
+inline void intrusive_ptr_release(Buffer* b) {
+    if (b->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        BufferPool::release(b);
+    }
+}
+
+#endif	/* BUFFERPOOL_HPP */
+
@@ -0,0 +1,93 @@
+/*
+ * File:   Codec.hpp
+ * Author: stels
+ *
+ * Created on December 20, 2013, 11:05 AM
+ */
+
+#ifndef CODEC_HPP
+#define	CODEC_HPP
+
+#include <cstdlib>
+#include <cstring>
+#include <sys/types.h>
+#include <endian.h>
+
+#include <boost/utility/string_ref.hpp>
+
+// Wire integers are 32 bit big-endian, read and written with one load or
+// store and a byte swap. Bodies are read through views into the message
+// buffer, nothing is copied or allocated.
+class Codec {
+public:
+
+    static u_int32_t load32(const char* p) {
+        u_int32_t n;
+        std::memcpy(&n, p, sizeof (n));
+        return be32toh(n);
+    }
+
+    static void store32(char* p, u_int32_t n) {
+        n = htobe32(n);
+        std::memcpy(p, &n, sizeof (n));
+    }
+
+    // Takes fields off the front of a body. A read past the end fails and
+    // leaves the target untouched, so defaults survive short bodies.
+    class Reader {
+    public:
+
+        Reader(const char* data, size_t length) : pos(data), end(data + length) {
+        }
+
+        explicit Reader(boost::string_ref body) : pos(body.data()), end(body.data() + body.size()) {
+        }
+
+        bool u32(u_int32_t& n) {
+            if (static_cast<size_t> (end - pos) < sizeof (n)) {
+                return false;
+            }
+            n = load32(pos);
+            pos += sizeof (n);
+            return true;
+        }
+
+        // A u32 length and that many bytes
+        bool bytes(boost::string_ref& out) {
+            u_int32_t length;
+            const char* start = pos;
+            if (!u32(length) || static_cast<size_t> (end - pos) < length) {
+                pos = start;
+                return false;
+            }
+            out = boost::string_ref(pos, length);
+            pos += length;
+            return true;
+        }
+
+        // Up to the next '\n' or the end, the '\n' is skipped
+        boost::string_ref line() {
+            const char* eol = static_cast<const char*> (std::memchr(pos, '\n', end - pos));
+            boost::string_ref out(pos, (eol ? eol : end) - pos);
+            pos = eol ? eol + 1 : end;
+            return out;
+        }
+
+        boost::string_ref rest() {
+            boost::string_ref out(pos, end - pos);
+            pos = end;
+            return out;
+        }
+
+        const char* position() const {
+            return pos;
+        }
+
+    private:
+        const char* pos;
+        const char* end;
+    };
+};
+
+#endif	/* CODEC_HPP */
+
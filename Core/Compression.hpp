@@ -0,0 +1,106 @@
+/*
+ * File:   Compression.hpp
+ * Author: stels
+ *
+ * Created on December 13, 2013, 5:48 PM
+ */
+
+#ifndef COMPRESSION_HPP
+#define	COMPRESSION_HPP
+
+#include <cstring>
+#include <zlib.h>
+
+#include "Message.hpp"
+
+// zlib on message bodies. Chat history is colored text repeating the same
+// escape sequences and names over and over, it shrinks several times even
+// at the fastest level. Setting up a stream costs a few hundred kilobytes,
+// so every thread keeps one of each kind and resets it between messages.
+class Compression {
+public:
+
+    // Replaces msg's body with its deflated form and sets COMPRESSED, keeps
+    // it as is when that wouldn't make it shorter
+    static bool compress(Message& msg) {
+        z_stream& z = deflater().stream;
+        deflateReset(&z);
+        Message out(msg.getMsgType(), msg.getvP(), msg.getFlags() | Message::COMPRESSED);
+        out.setCorrID(msg.getCorrID());
+        out.reserveBody(msg.getBodyLength());
+        z.next_in = reinterpret_cast<Bytef*> (msg.getBody());
+        z.avail_in = msg.getBodyLength();
+        z.next_out = reinterpret_cast<Bytef*> (out.getBody());
+        z.avail_out = msg.getBodyLength();
+        // Z_OK means the output ran out before the input did
+        if (deflate(&z, Z_FINISH) != Z_STREAM_END) {
+            return false;
+        }
+        out.setBodyLength(msg.getBodyLength() - z.avail_out);
+        msg = out;
+        return true;
+    }
+
+    // Undoes compress, false if the body is corrupt or inflates past
+    // MAX_LENGTH
+    static bool decompress(Message& msg) {
+        z_stream& z = inflater().stream;
+        inflateReset(&z);
+        Message out(msg.getMsgType(), msg.getvP(), msg.getFlags() & ~Message::COMPRESSED);
+        out.setCorrID(msg.getCorrID());
+        out.reserveBody(Message::MAX_LENGTH);
+        z.next_in = reinterpret_cast<Bytef*> (msg.getBody());
+        z.avail_in = msg.getBodyLength();
+        z.next_out = reinterpret_cast<Bytef*> (out.getBody());
+        z.avail_out = Message::MAX_LENGTH;
+        if (inflate(&z, Z_FINISH) != Z_STREAM_END) {
+            return false;
+        }
+        out.setBodyLength(Message::MAX_LENGTH - z.avail_out);
+        msg = out;
+        return true;
+    }
+
+private:
+
+    struct Deflater {
+
+        Deflater() {
+            std::memset(&stream, 0, sizeof (stream));
+            deflateInit(&stream, Z_BEST_SPEED);
+        }
+
+        ~Deflater() {
+            deflateEnd(&stream);
+        }
+
+        z_stream stream;
+    };
+
+    struct Inflater {
+
+        Inflater() {
+            std::memset(&stream, 0, sizeof (stream));
+            inflateInit(&stream);
+        }
+
+        ~Inflater() {
+            inflateEnd(&stream);
+        }
+
+        z_stream stream;
+    };
+
+    static Deflater& deflater() {
+        static thread_local Deflater d;
+        return d;
+    }
+
+    static Inflater& inflater() {
+        static thread_local Inflater i;
+        return i;
+    }
+};
+
+#endif	/* COMPRESSION_HPP */
+
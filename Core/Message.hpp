@@ -9,9 +9,13 @@
 #define	MESSAGEHEADER_HPP
 
 #include <cstring>
+#include <algorithm>
 #include <memory>
 #include <iostream>
-#include <boost/shared_array.hpp>
+#include <sstream>
+
+#include "BufferPool.hpp"
+#include "Codec.hpp"
 
 
 // 
@@ -20,22 +24,62 @@
 // |                               |                              |       ^
 // |              vP               |             msgID            |       |
 // |                               |                              |       |
-// +-------------------------------+------------------------------+    16 bytes
-// |                               |                              |       |
+// +-------------------------------+------------------------------+       |
+// |                               |                              |    20 bytes
 // |             flags             |            length            |       |
-// |                               |                              |       v
-// +-------------------------------+------------------------------+      ---
+// |                               |                              |       |
+// +-------------------------------+------------------------------+       |
+// |                               |                                      |
+// |            corrID             |                                      |
+// |                               |                                      v
+// +-------------------------------+                                     ---
+//
+// corrID is picked by the client for every request and echoed in the reply,
+// so requests can be pipelined. Pushes from the server carry 0.
+//
+// COMPRESSED in flags marks a zlib compressed body, see Compression.hpp. On
+// login_request it says the client can inflate, the server echoes it on
+// login_reply when it is going to compress large replies.
+//
+// In bodies states and counts are 32 bit big-endian like the header, names
+// in replies are a 32 bit length followed by the bytes. Text is sent as is.
+//
+// No frame is longer than MAX_LENGTH. Larger payloads, files and pastes, go
+// from one user to another as a stream of chunks, see streamOpenRequest.
+// The server forwards every chunk as it comes and holds at most a window
+// of them per stream.
 
 class Message {
 public:
 
     enum MessageType {
         login_request = 1, send_request = 3, fetch_request = 5, logout_request = 7,
-        login_reply = 2, send_reply = 4, fetch_reply = 6, logout_reply = 8
+        fetch_range_request = 9, subscribe_request = 11,
+        join_request = 15, leave_request = 17, room_send_request = 19, room_fetch_range_request = 21,
+        // Keeps an otherwise quiet connection from timing out, both bodies
+        // are empty
+        heartbeat_request = 23,
+        // Several lobby messages appended together, see sendBatchRequest
+        send_batch_request = 25,
+        stream_open_request = 27, stream_chunk_request = 29, stream_close_request = 31,
+        // login_reply and subscribe_reply bodies: <state>, the number of
+        // messages in the lobby
+        login_reply = 2, send_reply = 4, fetch_reply = 6, logout_reply = 8,
+        fetch_range_reply = 10, subscribe_reply = 12,
+        // Answers a fetch, fetch_range or subscribe whose state is older
+        // than anything the server still has. Body: <state to resume at>
+        // <room>, the room empty for the lobby. Pushed with corrID 0 when a
+        // subscriber falls that far behind.
+        truncated_reply = 14,
+        join_reply = 16, leave_reply = 18, room_send_reply = 20, room_fetch_range_reply = 22,
+        heartbeat_reply = 24, send_batch_reply = 26,
+        // Answer the stream requests and are pushed to the receiving end
+        // with corrID 0, see streamOpenRequest
+        stream_open_reply = 28, stream_chunk_reply = 30, stream_close_reply = 32
     };
 
     enum {
-        HEADER_LENGTH = 16
+        HEADER_LENGTH = 20
     };
 
     enum {
@@ -43,18 +87,41 @@ public:
     };
 
     enum {
-        VERSION = 1
+        VERSION = 3
+    };
+
+    enum {
+        // join_request without a state starts from the room's size
+        NO_STATE = 0xFFFFFFFF
+    };
+
+    enum Flags {
+        COMPRESSED = 1
+    };
+
+    enum {
+        // Payload bytes in one stream_chunk_request
+        CHUNK_LENGTH = MAX_LENGTH - 4
     };
 
-    Message() : data(new char[HEADER_LENGTH + MAX_LENGTH]) {
-        std::fill(data.get(), data.get() + HEADER_LENGTH + MAX_LENGTH, 0);
+    enum StreamStatus {
+        STREAM_OK = 0,
+        // Closed early by either end or lost with its connection
+        STREAM_ABORTED = 1
+    };
+
+    // Buffers start with room for the header only and grow to fit the body.
+    // Copies share the buffer.
+    Message() : data(BufferPool::acquire(HEADER_LENGTH)) {
+        std::fill(getData(), getData() + HEADER_LENGTH, 0);
     }
 
-    explicit Message(u_int32_t type, u_int32_t vProtocol = VERSION, u_int32_t flags = 0) : data(new char[HEADER_LENGTH + MAX_LENGTH]) {
-        std::fill(data.get(), data.get() + HEADER_LENGTH + MAX_LENGTH, 0);
+    explicit Message(u_int32_t type, u_int32_t vProtocol = VERSION, u_int32_t flags = 0) : data(BufferPool::acquire(HEADER_LENGTH)) {
         setvP(vProtocol);
         setMsgType(type);
         setFlags(flags);
+        setBodyLength(0);
+        setCorrID(0);
     }
 
     Message(const Message&) = default;
@@ -63,17 +130,30 @@ public:
 
     void fillBody(const std::string& msg) {
         if (msg.size() < MAX_LENGTH) {
+            reserveBody(msg.size());
             std::memcpy(getBody(), msg.c_str(), msg.size());
             setBodyLength(msg.size());
         }
     }
 
+    // Makes room for a body of length bytes keeping the header and the body
+    // so far, the buffer is only replaced when it is too small. The header's
+    // length may already be the new one, only what the old buffer holds is
+    // kept.
+    void reserveBody(size_t length) {
+        if (data->capacity() < HEADER_LENGTH + length) {
+            BufferPool::Ptr bigger = BufferPool::acquire(HEADER_LENGTH + length);
+            std::memcpy(bigger->data(), data->data(), std::min(data->capacity(), getDataLength()));
+            data.swap(bigger);
+        }
+    }
+
     friend std::istream& operator>>(std::istream& is, Message& header) {
-        return is.read(reinterpret_cast<char*> (header.data.get()), HEADER_LENGTH);
+        return is.read(header.getData(), HEADER_LENGTH);
     }
 
     friend std::ostream& operator<<(std::ostream& os, const Message& header) {
-        return os.write(reinterpret_cast<const char*> (header.data.get()), HEADER_LENGTH);
+        return os.write(header.getData(), HEADER_LENGTH);
     }
 
     u_int32_t getBodyLength() const {
@@ -92,6 +172,10 @@ public:
         return decode(8);
     }
 
+    u_int32_t getCorrID() const {
+        return decode(16);
+    }
+
     void setvP(u_int32_t n) {
         encode(0, n);
     }
@@ -108,6 +192,36 @@ public:
         encode(12, n);
     }
 
+    void setCorrID(u_int32_t n) {
+        encode(16, n);
+    }
+
+    // Adds to the end of the body. Bodies are kept under MAX_LENGTH by the
+    // caller.
+    void appendU32(u_int32_t n) {
+        size_t length = getBodyLength();
+        reserveBody(length + sizeof (n));
+        Codec::store32(getBody() + length, n);
+        setBodyLength(length + sizeof (n));
+    }
+
+    void append(boost::string_ref bytes) {
+        size_t length = getBodyLength();
+        reserveBody(length + bytes.size());
+        std::memcpy(getBody() + length, bytes.data(), bytes.size());
+        setBodyLength(length + bytes.size());
+    }
+
+    // A u32 length and the bytes
+    void appendBytes(boost::string_ref bytes) {
+        appendU32(bytes.size());
+        append(bytes);
+    }
+
+    boost::string_ref getBodyView() const {
+        return boost::string_ref(getBody(), getBodyLength());
+    }
+
     bool verifyHeader() {
         if (getBodyLength() > MAX_LENGTH) {
             setBodyLength(0);
@@ -117,11 +231,11 @@ public:
     }
 
     char* getData() {
-        return data.get();
+        return data->data();
     }
 
     const char* getData() const {
-        return data.get();
+        return data->data();
     }
 
     size_t getDataLength() const {
@@ -129,40 +243,192 @@ public:
     }
 
     char* getBody() {
-        return data.get() + HEADER_LENGTH;
+        return getData() + HEADER_LENGTH;
     }
 
     const char* getBody() const {
-        return data.get() + HEADER_LENGTH;
+        return getData() + HEADER_LENGTH;
     }
 
     static Message logoutRequest() {
         return Message(logout_request);
     }
 
+    static Message heartbeatRequest() {
+        return Message(heartbeat_request);
+    }
+
     static Message sendRequest(const std::string& str) {
         Message msg(send_request);
         msg.fillBody(str);
         return msg;
     }
+
+    // Body: <length> <text> for every message. Takes lines from first on
+    // while they fit in one body and leaves first at the next one, lines
+    // too long for any body are skipped. The reply body is <state> <count>,
+    // the index the first message got and how many were appended.
+    template <typename It>
+    static Message sendBatchRequest(It& first, It last) {
+        Message msg(send_batch_request);
+        for (; first != last; ++first) {
+            if (sizeof (u_int32_t) + first->size() > MAX_LENGTH) {
+                continue;
+            }
+            if (msg.getBodyLength() + sizeof (u_int32_t) + first->size() > MAX_LENGTH) {
+                break;
+            }
+            msg.appendBytes(*first);
+        }
+        return msg;
+    }
+
+    // Body: <user> <description>, the user's name as a length and the
+    // bytes. The reply body is <stream> <window>, empty when the user isn't
+    // logged in. The user gets a stream_open_reply push with body <stream>
+    // <sender> <description>. The description is cut to fit both the
+    // request and the push, sender is the name the request is sent under.
+    static Message streamOpenRequest(const std::string& user, const std::string& sender,
+            const std::string& description) {
+        Message msg(stream_open_request);
+        msg.appendBytes(user);
+        size_t room = std::min(fitting(sizeof (u_int32_t) + user.size()), streamDescriptionRoom(sender.size()));
+        msg.append(description.substr(0, room));
+        return msg;
+    }
+
+    // Bytes left for the description in a stream_open_reply from a sender
+    // with a name that long
+    static size_t streamDescriptionRoom(size_t senderLength) {
+        return fitting(2 * sizeof (u_int32_t) + senderLength);
+    }
+
+    // Body: <stream> <data>, up to CHUNK_LENGTH bytes of it. The data is
+    // pushed to the receiver as a stream_chunk_reply with the same body.
+    // The reply body is <stream> <status> and comes once the data was
+    // written to the receiver, at most window chunks may wait for theirs.
+    static Message streamChunkRequest(u_int32_t stream, const char* data, size_t length) {
+        Message msg(stream_chunk_request);
+        msg.appendU32(stream);
+        msg.append(boost::string_ref(data, std::min<size_t>(length, CHUNK_LENGTH)));
+        return msg;
+    }
+
+    // Body: <stream>. Either end may close, the other gets a
+    // stream_close_reply push with body <stream> <status>: STREAM_OK when
+    // the sender closed with every chunk answered, STREAM_ABORTED
+    // otherwise. The reply body is <stream> <status>, STREAM_ABORTED if
+    // the stream was gone already.
+    static Message streamCloseRequest(u_int32_t stream) {
+        Message msg(stream_close_request);
+        msg.appendU32(stream);
+        return msg;
+    }
+
+    // Body: <state>. The reply body is the message's text, empty when
+    // there is none yet.
+    static Message fetchRequest(u_int32_t state) {
+        Message msg(fetch_request);
+        msg.appendU32(state);
+        return msg;
+    }
+
+    // Body: <state> <maxCount> <maxBytes>. The reply body is the new state
+    // and the room, empty for the lobby, followed by the messages as
+    // complete fetch_reply frames, header included. Use rangeHead and
+    // nextFrame to walk it.
+    static Message fetchRangeRequest(u_int32_t state, u_int32_t maxCount, u_int32_t maxBytes = MAX_LENGTH) {
+        Message msg(fetch_range_request);
+        msg.appendU32(state);
+        msg.appendU32(maxCount);
+        msg.appendU32(maxBytes);
+        return msg;
+    }
+
+    // Body: <state>. After the reply the server pushes every message from
+    // state on as fetch_range_reply frames, no further fetches are needed.
+    static Message subscribeRequest(u_int32_t state) {
+        Message msg(subscribe_request);
+        msg.appendU32(state);
+        return msg;
+    }
+
+    // Rooms other than the lobby. Body: <state> followed by the room name,
+    // NO_STATE starts from the room's size. The reply body is the room's
+    // size, empty if the name isn't valid or the server has too many
+    // rooms to open another. From then on the room's messages
+    // are pushed like the lobby's with the room name in the head.
+    static Message joinRequest(const std::string& room, u_int32_t state = NO_STATE) {
+        Message msg(join_request);
+        msg.appendU32(state);
+        msg.append(room);
+        return msg;
+    }
+
+    // Body: "<room>". Stops the room's pushes.
+    static Message leaveRequest(const std::string& room) {
+        Message msg(leave_request);
+        msg.fillBody(room);
+        return msg;
+    }
+
+    // Body: "<room>\n<message>". Only members can send, otherwise the reply
+    // body says why the message was refused.
+    static Message roomSendRequest(const std::string& room, const std::string& str) {
+        Message msg(room_send_request);
+        msg.fillBody(room + "\n" + str);
+        return msg;
+    }
+
+    // Body: <state> <maxCount> <maxBytes> followed by the room name. The
+    // reply is laid out like a fetch_range_reply.
+    static Message roomFetchRangeRequest(const std::string& room, u_int32_t state, u_int32_t maxCount,
+            u_int32_t maxBytes = MAX_LENGTH) {
+        Message msg(room_fetch_range_request);
+        msg.appendU32(state);
+        msg.appendU32(maxCount);
+        msg.appendU32(maxBytes);
+        msg.append(room);
+        return msg;
+    }
+
+    // Reads the state and room a fetch_range_reply or truncated_reply
+    // starts with, the frames follow
+    static bool rangeHead(Codec::Reader& reader, u_int32_t& state, boost::string_ref& room) {
+        return reader.u32(state) && reader.bytes(room);
+    }
+
+    // Reads the frame at pos and moves pos past it, false if the rest of
+    // the buffer doesn't hold a whole frame
+    static bool nextFrame(const char*& pos, const char* end, u_int32_t& type, const char*& body, u_int32_t& length) {
+        if (end - pos < HEADER_LENGTH) {
+            return false;
+        }
+        type = Codec::load32(pos + 4);
+        length = Codec::load32(pos + 12);
+        if (static_cast<size_t> (end - pos - HEADER_LENGTH) < length) {
+            return false;
+        }
+        body = pos + HEADER_LENGTH;
+        pos = body + length;
+        return true;
+    }
 private:
 
+    // What a body with used bytes taken still has room for, 0 when full
+    static size_t fitting(size_t used) {
+        return used < MAX_LENGTH ? MAX_LENGTH - used : 0;
+    }
+
     u_int32_t decode(int a) const {
-        u_int32_t res = 0;
-        for (int i = 0; i < 4; ++i) {
-            res += data[a + i] << (8 * (3 - i));
-        }
-        return res;
+        return Codec::load32(getData() + a);
     }
 
     void encode(int a, u_int32_t n) {
-        data[a] = static_cast<unsigned char> (n >> 24);
-        data[a + 1] = static_cast<unsigned char> ((n >> 16) & (0xFF));
-        data[a + 2] = static_cast<unsigned char> ((n >> 8) & (0xFF));
-        data[a + 3] = static_cast<unsigned char> (n & 0xFF);
+        Codec::store32(getData() + a, n);
     }
 
-    boost::shared_array<char> data;
+    BufferPool::Ptr data;
 
 };
 
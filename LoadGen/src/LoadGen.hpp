@@ -0,0 +1,158 @@
+/*
+ * File:   LoadGen.hpp
+ * Author: stels
+ *
+ * Created on December 19, 2013, 12:15 PM
+ */
+
+#ifndef LOADGEN_HPP
+#define	LOADGEN_HPP
+
+#include <cstdlib>
+#include <sys/types.h>
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "../../Core/Message.hpp"
+#include "../../Server/include/Histogram.hpp"
+
+using boost::asio::ip::tcp;
+
+struct LoadConfig {
+
+    LoadConfig() : host("localhost"), port("33333"), sessions(1000), threads(2), duration(60),
+    ramp(LINEAR), rampSeconds(10), sendRate(0.2), fetchRate(0.2), fetchCount(16), size(64), batch(1),
+    subscribe(false), compress(false), heartbeat(30), interval(1) {
+    }
+
+    enum Ramp {
+        // All sessions at once, added evenly over rampSeconds, or in ten
+        // equal steps over rampSeconds
+        NONE, LINEAR, STEP
+    };
+
+    std::string host;
+    std::string port;
+    size_t sessions;
+    // io threads, each with its own io_service
+    size_t threads;
+    // Seconds the whole run takes, ramp included
+    double duration;
+    Ramp ramp;
+    double rampSeconds;
+    // Requests per second of every session, exponentially spaced
+    double sendRate;
+    double fetchRate;
+    // fetch_range asks for this many messages after the last it has seen
+    size_t fetchCount;
+    // Body bytes of every message sent
+    size_t size;
+    // Messages in every send, more than one goes as a send_batch_request
+    // packed up to the body limit
+    size_t batch;
+    // Sessions subscribe to the lobby and take its pushes
+    bool subscribe;
+    bool compress;
+    // A session that wrote nothing for this many seconds sends a
+    // heartbeat_request, 0 never does
+    double heartbeat;
+    // Seconds between CSV lines
+    double interval;
+};
+
+// Everything a session records goes to the worker of the thread it runs
+// on, so each histogram has one writer
+struct Worker : boost::noncopyable {
+
+    enum Kind {
+        SEND, FETCH, KINDS
+    };
+
+    Worker() : service(), work(service), random(std::random_device()()), errors(0) {
+    }
+
+    void record(Kind kind, std::chrono::steady_clock::duration elapsed) {
+        latencies[kind].record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+
+    boost::asio::io_service service;
+    boost::asio::io_service::work work;
+    std::mt19937 random;
+    Histogram latencies[KINDS];
+    std::atomic<u_int64_t> errors;
+};
+
+// One simulated user: logs in, optionally subscribes, then sends and
+// fetches at the configured rates until the run ends
+class Session : public boost::enable_shared_from_this<Session>, boost::noncopyable {
+public:
+    typedef boost::shared_ptr<Session> Ptr;
+
+    Session(Worker& worker, const LoadConfig& config, const std::string& username);
+
+    void start(tcp::resolver::iterator endpoints);
+
+private:
+
+    void onConnect();
+
+    void schedule(boost::asio::deadline_timer& timer, double rate, void (Session::*action)());
+
+    void doSend();
+
+    void doFetch();
+
+    void startHeartbeat();
+
+    void write(Message m, Worker::Kind kind);
+
+    void doFlush();
+
+    void doReadHeader();
+
+    void doReadBody();
+
+    void handleReply();
+
+    void fail();
+
+    // A request waiting for its reply
+    struct Pending {
+        u_int32_t corrID;
+        Worker::Kind kind;
+        std::chrono::steady_clock::time_point sent;
+    };
+
+    Worker& worker;
+    const LoadConfig& config;
+    std::string username;
+    tcp::socket socket_;
+    boost::asio::deadline_timer sendTimer;
+    boost::asio::deadline_timer fetchTimer;
+    boost::asio::deadline_timer heartbeatTimer;
+    Message readMsg;
+    std::deque<Message> writeQueue;
+    bool writing;
+    // Since the heartbeat timer was armed
+    bool wrote;
+    // Replies come back in request order
+    std::deque<Pending> pending;
+    u_int32_t nextCorrID;
+    u_int32_t state;
+    bool running;
+    bool failed;
+    std::string text;
+};
+
+#endif	/* LOADGEN_HPP */
+
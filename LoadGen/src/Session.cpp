@@ -0,0 +1,215 @@
+/*
+ * File:   Session.cpp
+ * Author: stels
+ *
+ * Created on December 19, 2013, 12:15 PM
+ */
+
+#include "../../Core/Compression.hpp"
+#include "LoadGen.hpp"
+
+Session::Session(Worker& worker, const LoadConfig& config, const std::string& username) :
+worker(worker),
+config(config),
+username(username),
+socket_(worker.service),
+sendTimer(worker.service),
+fetchTimer(worker.service),
+heartbeatTimer(worker.service),
+readMsg(),
+writeQueue(),
+writing(false),
+wrote(false),
+pending(),
+nextCorrID(1),
+state(0),
+running(false),
+failed(false),
+text(std::min<size_t>(config.size, Message::MAX_LENGTH - 1), 'x') {
+}
+
+void Session::start(tcp::resolver::iterator endpoints) {
+    Ptr self = shared_from_this();
+    boost::asio::async_connect(socket_, endpoints,
+            [this, self](boost::system::error_code ec, tcp::resolver::iterator) {
+                if (ec) {
+                    fail();
+                    return;
+                }
+                onConnect();
+            });
+}
+
+void Session::onConnect() {
+    running = true;
+    boost::system::error_code ec;
+    socket_.set_option(tcp::no_delay(true), ec);
+    Message login(Message::login_request, Message::VERSION, config.compress ? Message::COMPRESSED : 0);
+    login.fillBody(username);
+    write(login, Worker::KINDS);
+    doReadHeader();
+}
+
+void Session::schedule(boost::asio::deadline_timer& timer, double rate, void (Session::*action)()) {
+    if (rate <= 0 || !running) {
+        return;
+    }
+    std::exponential_distribution<double> gap(rate);
+    timer.expires_from_now(boost::posix_time::microseconds(
+            static_cast<long> (gap(worker.random) * 1e6)));
+    Ptr self = shared_from_this();
+    timer.async_wait([this, self, &timer, rate, action](const boost::system::error_code & ec) {
+        if (ec || !running) {
+            return;
+        }
+        (this->*action)();
+        schedule(timer, rate, action);
+    });
+}
+
+void Session::doSend() {
+    if (config.batch > 1) {
+        std::vector<std::string> lines(config.batch, text);
+        std::vector<std::string>::const_iterator first = lines.begin();
+        write(Message::sendBatchRequest(first, lines.cend()), Worker::SEND);
+    } else {
+        write(Message::sendRequest(text), Worker::SEND);
+    }
+}
+
+void Session::doFetch() {
+    write(Message::fetchRangeRequest(state, config.fetchCount), Worker::FETCH);
+}
+
+void Session::startHeartbeat() {
+    if (config.heartbeat <= 0 || !running) {
+        return;
+    }
+    wrote = false;
+    heartbeatTimer.expires_from_now(boost::posix_time::microseconds(static_cast<long> (config.heartbeat * 1e6)));
+    Ptr self = shared_from_this();
+    heartbeatTimer.async_wait([this, self](const boost::system::error_code & ec) {
+        if (ec || !running) {
+            return;
+        }
+        if (!wrote) {
+            write(Message::heartbeatRequest(), Worker::KINDS);
+        }
+        startHeartbeat();
+    });
+}
+
+void Session::write(Message m, Worker::Kind kind) {
+    u_int32_t id = nextCorrID++;
+    if (nextCorrID == 0) {
+        nextCorrID = 1;
+    }
+    m.setCorrID(id);
+    Pending p = {id, kind, std::chrono::steady_clock::now()};
+    pending.push_back(p);
+    writeQueue.push_back(m);
+    doFlush();
+}
+
+void Session::doFlush() {
+    if (writing || writeQueue.empty()) {
+        return;
+    }
+    writing = true;
+    wrote = true;
+    const Message& m = writeQueue.front();
+    Ptr self = shared_from_this();
+    boost::asio::async_write(socket_, boost::asio::buffer(m.getData(), m.getDataLength()),
+            [this, self](boost::system::error_code ec, std::size_t) {
+                if (ec) {
+                    fail();
+                    return;
+                }
+                writeQueue.pop_front();
+                writing = false;
+                doFlush();
+            });
+}
+
+void Session::doReadHeader() {
+    Ptr self = shared_from_this();
+    boost::asio::async_read(socket_, boost::asio::buffer(readMsg.getData(), Message::HEADER_LENGTH),
+            [this, self](boost::system::error_code ec, std::size_t) {
+                if (ec || !readMsg.verifyHeader()) {
+                    fail();
+                    return;
+                }
+                readMsg.reserveBody(readMsg.getBodyLength());
+                doReadBody();
+            });
+}
+
+void Session::doReadBody() {
+    Ptr self = shared_from_this();
+    boost::asio::async_read(socket_, boost::asio::buffer(readMsg.getBody(), readMsg.getBodyLength()),
+            [this, self](boost::system::error_code ec, std::size_t) {
+                if (ec) {
+                    fail();
+                    return;
+                }
+                // On login_reply the flag only confirms compression
+                if ((readMsg.getFlags() & Message::COMPRESSED) && readMsg.getMsgType() != Message::login_reply
+                        && !Compression::decompress(readMsg)) {
+                    fail();
+                    return;
+                }
+                handleReply();
+                if (running) {
+                    doReadHeader();
+                }
+            });
+}
+
+void Session::handleReply() {
+    // Pushes to subscribers carry no corrID
+    if (readMsg.getCorrID() == 0) {
+        return;
+    }
+    if (pending.empty() || pending.front().corrID != readMsg.getCorrID()) {
+        fail();
+        return;
+    }
+    Pending p = pending.front();
+    pending.pop_front();
+    if (p.kind != Worker::KINDS) {
+        worker.record(p.kind, std::chrono::steady_clock::now() - p.sent);
+    }
+    Codec::Reader reader(readMsg.getBodyView());
+    switch (readMsg.getMsgType()) {
+        case Message::login_reply:
+            // Starts from the messages there are now, not the whole history
+            reader.u32(state);
+            if (config.subscribe) {
+                write(Message::subscribeRequest(state), Worker::KINDS);
+            }
+            schedule(sendTimer, config.sendRate, &Session::doSend);
+            schedule(fetchTimer, config.fetchRate, &Session::doFetch);
+            startHeartbeat();
+            break;
+        case Message::fetch_range_reply:
+        case Message::truncated_reply:
+            reader.u32(state);
+            break;
+        default:
+            break;
+    }
+}
+
+void Session::fail() {
+    if (failed) {
+        return;
+    }
+    failed = true;
+    running = false;
+    worker.errors.fetch_add(1, std::memory_order_relaxed);
+    boost::system::error_code ec;
+    socket_.close(ec);
+    sendTimer.cancel(ec);
+    fetchTimer.cancel(ec);
+    heartbeatTimer.cancel(ec);
+}
@@ -0,0 +1,188 @@
+/*
+ * File:   main.cpp
+ * Author: stels
+ *
+ * Created on December 19, 2013, 12:15 PM
+ */
+
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <fstream>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <boost/thread.hpp>
+#include <boost/make_shared.hpp>
+
+#include "LoadGen.hpp"
+
+static void usage(const char* name) {
+    std::cerr << "Usage: " << name << " [--host H] [--port P] [--sessions N] [--threads N]"
+            << " [--duration S] [--ramp none|linear|step] [--ramp-seconds S]"
+            << " [--send-rate R] [--fetch-rate R] [--fetch-count N] [--size BYTES] [--batch N]"
+            << " [--subscribe] [--compress] [--heartbeat S] [--interval S] [--out FILE]" << std::endl;
+}
+
+// Sessions that should be running t seconds into the run
+static size_t target(const LoadConfig& config, double t) {
+    if (config.ramp == LoadConfig::NONE || config.rampSeconds <= 0 || t >= config.rampSeconds) {
+        return config.sessions;
+    }
+    double share = t / config.rampSeconds;
+    if (config.ramp == LoadConfig::STEP) {
+        share = std::floor(share * 10 + 1) / 10;
+    }
+    return static_cast<size_t> (config.sessions * share);
+}
+
+// Takes what every worker recorded since the last call, on the worker's
+// own thread so the histograms keep a single writer
+static void collect(std::vector<boost::shared_ptr<Worker> >& workers, Histogram (&out)[Worker::KINDS]) {
+    std::mutex mutex;
+    std::condition_variable done;
+    size_t left = workers.size();
+    for (auto& w : workers) {
+        Worker* worker = w.get();
+        worker->service.post([&, worker]() {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (size_t k = 0; k < Worker::KINDS; ++k) {
+                out[k].add(worker->latencies[k]);
+                worker->latencies[k].reset();
+            }
+            if (--left == 0) {
+                done.notify_one();
+            }
+        });
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&left]() {
+        return left == 0;
+    });
+}
+
+static void percentiles(std::ostream& os, const Histogram& h) {
+    os << ";" << h.percentile(0.5) / 1000 << ";" << h.percentile(0.9) / 1000
+            << ";" << h.percentile(0.99) / 1000 << ";" << h.percentile(0.999) / 1000
+            << ";" << h.getMax() / 1000;
+}
+
+int main(int argc, char** argv) {
+    LoadConfig config;
+    std::string out("loadgen.csv");
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--host") == 0 && i + 1 < argc) {
+            config.host = argv[++i];
+        } else if (std::strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            config.port = argv[++i];
+        } else if (std::strcmp(argv[i], "--sessions") == 0 && i + 1 < argc) {
+            config.sessions = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            config.threads = std::max<size_t>(std::strtoul(argv[++i], nullptr, 10), 1);
+        } else if (std::strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+            config.duration = std::strtod(argv[++i], nullptr);
+        } else if (std::strcmp(argv[i], "--ramp") == 0 && i + 1 < argc) {
+            ++i;
+            if (std::strcmp(argv[i], "none") == 0) {
+                config.ramp = LoadConfig::NONE;
+            } else if (std::strcmp(argv[i], "step") == 0) {
+                config.ramp = LoadConfig::STEP;
+            } else {
+                config.ramp = LoadConfig::LINEAR;
+            }
+        } else if (std::strcmp(argv[i], "--ramp-seconds") == 0 && i + 1 < argc) {
+            config.rampSeconds = std::strtod(argv[++i], nullptr);
+        } else if (std::strcmp(argv[i], "--send-rate") == 0 && i + 1 < argc) {
+            config.sendRate = std::strtod(argv[++i], nullptr);
+        } else if (std::strcmp(argv[i], "--fetch-rate") == 0 && i + 1 < argc) {
+            config.fetchRate = std::strtod(argv[++i], nullptr);
+        } else if (std::strcmp(argv[i], "--fetch-count") == 0 && i + 1 < argc) {
+            config.fetchCount = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            config.size = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            config.batch = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--subscribe") == 0) {
+            config.subscribe = true;
+        } else if (std::strcmp(argv[i], "--compress") == 0) {
+            config.compress = true;
+        } else if (std::strcmp(argv[i], "--heartbeat") == 0 && i + 1 < argc) {
+            config.heartbeat = std::strtod(argv[++i], nullptr);
+        } else if (std::strcmp(argv[i], "--interval") == 0 && i + 1 < argc) {
+            config.interval = std::max(std::strtod(argv[++i], nullptr), 0.1);
+        } else if (std::strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            out = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    std::vector<boost::shared_ptr<Worker> > workers;
+    boost::thread_group threads;
+    for (size_t i = 0; i < config.threads; ++i) {
+        workers.push_back(boost::make_shared<Worker>());
+        Worker* worker = workers.back().get();
+        threads.create_thread([worker]() {
+            worker->service.run();
+        });
+    }
+    tcp::resolver resolver(workers.front()->service);
+    tcp::resolver::iterator endpoints = resolver.resolve(tcp::resolver::query(config.host, config.port));
+
+    // One line per interval: seconds;sessions;sends;fetches;errors, then
+    // p50;p90;p99;p999;max in microseconds for send and for fetch
+    std::ofstream csv(out);
+    csv << "seconds;sessions;sends;fetches;errors"
+            << ";send_p50;send_p90;send_p99;send_p999;send_max"
+            << ";fetch_p50;fetch_p90;fetch_p99;fetch_p999;fetch_max" << std::endl;
+    Histogram total[Worker::KINDS];
+    size_t started = 0;
+    auto begin = std::chrono::steady_clock::now();
+    auto nextReport = begin + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(config.interval));
+    while (true) {
+        double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        if (t >= config.duration) {
+            break;
+        }
+        for (size_t want = target(config, t); started < want; ++started) {
+            Worker& worker = *workers[started % workers.size()];
+            Session::Ptr session = boost::make_shared<Session>(worker, config, "load" + std::to_string(started));
+            worker.service.post([session, endpoints]() {
+                session->start(endpoints);
+            });
+        }
+        if (std::chrono::steady_clock::now() >= nextReport) {
+            Histogram interval[Worker::KINDS];
+            collect(workers, interval);
+            u_int64_t errors = 0;
+            for (auto& w : workers) {
+                errors += w->errors.load(std::memory_order_relaxed);
+            }
+            csv << t << ";" << started << ";" << interval[Worker::SEND].count()
+                    << ";" << interval[Worker::FETCH].count() << ";" << errors;
+            percentiles(csv, interval[Worker::SEND]);
+            percentiles(csv, interval[Worker::FETCH]);
+            csv << std::endl;
+            for (size_t k = 0; k < Worker::KINDS; ++k) {
+                total[k].add(interval[k]);
+            }
+            nextReport += std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                    std::chrono::duration<double>(config.interval));
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    collect(workers, total);
+    for (auto& w : workers) {
+        w->service.stop();
+    }
+    threads.join_all();
+    std::cout << "sessions " << started << " sends " << total[Worker::SEND].count()
+            << " fetches " << total[Worker::FETCH].count() << " in " << config.duration << "s" << std::endl;
+    std::cout << "send  p50/p90/p99/p999/max us";
+    percentiles(std::cout, total[Worker::SEND]);
+    std::cout << std::endl << "fetch p50/p90/p99/p999/max us";
+    percentiles(std::cout, total[Worker::FETCH]);
+    std::cout << std::endl;
+}
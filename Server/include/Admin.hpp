@@ -0,0 +1,55 @@
+/*
+ * File:   Admin.hpp
+ * Author: stels
+ *
+ * Created on December 18, 2013, 2:30 PM
+ */
+
+#ifndef ADMIN_HPP
+#define	ADMIN_HPP
+
+#include <cstdlib>
+#include <string>
+
+#include <boost/asio.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/noncopyable.hpp>
+
+using namespace boost::asio;
+
+// One scrape on the admin port: reads an HTTP request, answers GET
+// /metrics with Server::printMetrics and closes the connection
+class AdminSession : public boost::enable_shared_from_this<AdminSession>, boost::noncopyable {
+public:
+    typedef boost::shared_ptr<AdminSession> Ptr;
+
+    static Ptr create(io_service& service) {
+        return Ptr(new AdminSession(service));
+    }
+
+    ip::tcp::socket& sock() {
+        return socket_;
+    }
+
+    void start();
+
+private:
+
+    enum {
+        // Requests with headers longer than this are dropped
+        MAX_REQUEST = 8192
+    };
+
+    explicit AdminSession(io_service& service) : socket_(service), request(MAX_REQUEST), response() {
+    }
+
+    void reply(const std::string& status, const std::string& body);
+
+    ip::tcp::socket socket_;
+    boost::asio::streambuf request;
+    std::string response;
+};
+
+#endif	/* ADMIN_HPP */
+
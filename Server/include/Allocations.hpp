@@ -0,0 +1,23 @@
+/*
+ * File:   Allocations.hpp
+ * Author: stels
+ *
+ * Created on December 22, 2013, 10:15 AM
+ */
+
+#ifndef ALLOCATIONS_HPP
+#define	ALLOCATIONS_HPP
+
+#include <cstdlib>
+#include <sys/types.h>
+
+// Every operator new in the process, not only the pool's buffers, so a
+// path meant to be allocation free can be checked. Allocations.cpp
+// replaces the global operator new, linking it in is all it takes.
+class Allocations {
+public:
+
+    static u_int64_t count();
+};
+
+#endif	/* ALLOCATIONS_HPP */
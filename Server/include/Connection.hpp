@@ -16,7 +16,10 @@
 #include <sstream>
 #include <fstream>
 #include <string>
+#include <deque>
 #include <utility>
+#include <chrono>
+#include <atomic>
 
 #include <boost/range/numeric.hpp>
 #include <boost/range/adaptor/transformed.hpp>
@@ -29,88 +32,407 @@
 #include <boost/thread.hpp>
 
 #include "../../Core/Message.hpp"
+#include "Room.hpp"
+#include "Counters.hpp"
+#include "SlotMap.hpp"
+#include "TimingWheel.hpp"
+#include "HandlerMemory.hpp"
 
 using namespace boost::asio;
 using namespace boost::posix_time;
 
+// Everything but the getters below runs on the connection's shard, whose
+// service has one thread, so the connection's handlers never run at once
+// and it needs no lock. Other threads reach it by posting to getService().
 class Connection : public boost::enable_shared_from_this<Connection>, boost::noncopyable {
 public:
     typedef boost::system::error_code ErrorCode;
     typedef boost::shared_ptr<Connection> Ptr;
+    // Every shard keeps the timeouts of its connections in one wheel
+    // ticking once a second
+    typedef TimingWheel<boost::weak_ptr<Connection> > Timers;
+
+    // What happens to a subscriber that falls more than maxLag messages
+    // behind a room
+    enum SlowPolicy {
+        // The oldest messages past maxLag are never pushed
+        DROP,
+        // Skips to the room's tail and pushes a truncated_reply, the client
+        // can fetch the gap if it cares
+        SKIP,
+        DISCONNECT
+    };
+
+    // Bounds on what one connection may have queued for writing, so a
+    // client that doesn't read can't pin server memory
+    struct Limits {
+
+        Limits() : highWater(1 << 20), lowWater(256 << 10), maxFrames(1024), maxLag(10000), policy(SKIP),
+        idleTimeout(120), writeTimeout(60) {
+        }
+
+        // Reading stops once this many bytes or frames are queued and
+        // resumes when the bytes are down to lowWater. Pushes wait too, the
+        // subscriber lags behind the room instead.
+        size_t highWater;
+        size_t lowWater;
+        size_t maxFrames;
+        size_t maxLag;
+        SlowPolicy policy;
+        // Seconds a connection may go without sending anything and a write
+        // may take before the connection is closed, 0 waits forever. Quiet
+        // clients send heartbeat_request to stay connected.
+        size_t idleTimeout;
+        size_t writeTimeout;
+    };
 
     void start();
 
-    static Ptr createNewUser();
+    // shard is the index of the server shard service belongs to
+    static Ptr createNewUser(io_service& service, size_t shard = 0);
 
+    // On the shard's thread like the handlers, or once the shards stopped
     void stop();
 
     bool started() const;
 
     ip::tcp::socket& sock();
 
+    // The shard's service all handlers of this connection run on
+    io_service& getService();
+
     std::string getUsername() const;
 
-    long long getAllTime() const;
+    long long getWriteCounter() const;
+
+    long long getFrameCounter() const;
+
+    size_t getQueuedBytes() const;
+
+    // Body bytes of the compressed replies before compression and what it
+    // saved on them
+    long long getCompressedBytes() const;
+
+    long long getCompressedSaved() const;
+
+    size_t getShard() const;
+
+    // Stable for the connection's life, unique within its shard. Given by
+    // the shard's registry on start.
+    SlotMap<Ptr>::Id getId() const;
+
+    void setId(SlotMap<Ptr>::Id registered);
+
+    // Sends messages appended since the last push, subscribers only
+    void pushMessages();
 
-    long long getRequestCounter() const;
+    // Any thread. Marks a push as posted, false if one already is and
+    // will see the news, so each subscriber has at most one post waiting.
+    bool claimPush();
 
+    // Called by the shard's timers, closes the connection if it timed out.
+    // Returns the tick to look again at, 0 once stopped.
+    Timers::Tick checkTimeouts(Timers::Tick now);
 
 private:
     typedef Connection SelfType;
 
-    Connection();
+    Connection(io_service& service, size_t shard);
 
-    void handleRequest(Message);
+    // Calls the handler of the request's type, others are ignored
+    void handleRequest(const Message&);
 
 
     // Handlers
     ////////////////////////////////////////////////////////////////////////////////
 
-    void onLogin(Message);
+    void onLogin(const Message&);
 
     void replyLogin();
 
-    void onFetch(Message);
+    void onFetch(const Message&);
 
     void replyFetch(u_int32_t state);
 
-    void onSend(Message);
+    void onFetchRange(const Message&);
+
+    void replyFetchRange(const Room& room, u_int32_t type, u_int32_t state, u_int32_t maxCount, u_int32_t maxBytes);
+
+    // A reply or push on its way out. The pieces point into messages held
+    // until the write completes, history frames are written straight from
+    // the log without copying. Replies have a piece or two, held inline.
+    struct Outgoing {
+
+        Outgoing() : messages(), buffers(), bytes(0), reply(true), streamed(false), stream(0), requestType(0),
+        started() {
+        }
+
+        void add(const Message& m, size_t offset, size_t length) {
+            messages.push_back(m);
+            buffers.push_back(buffer(m.getData() + offset, length));
+            bytes += length;
+        }
+
+        void append(const Outgoing& other) {
+            messages.insert(messages.end(), other.messages.begin(), other.messages.end());
+            buffers.insert(buffers.end(), other.buffers.begin(), other.buffers.end());
+            bytes += other.bytes;
+        }
+
+        std::vector<Message> messages;
+        std::vector<const_buffer> buffers;
+        size_t bytes;
+        // Replies complete a request once written, pushes don't
+        bool reply;
+        // Stream pushes don't hold up room pushes. stream is the id of the
+        // chunk's stream, 0 for the open and close notices.
+        bool streamed;
+        u_int32_t stream;
+        u_int32_t requestType;
+        std::chrono::steady_clock::time_point started;
+    };
+
+    // A written Outgoing's vectors keep their capacity for the next reply
+    Outgoing takeOutgoing();
+
+    void recycle(Outgoing&& out);
+
+    // A truncated_reply when state has left the room's history
+    Outgoing rangeReply(const Room& room, u_int32_t type, u_int32_t state,
+            u_int32_t maxCount, u_int32_t maxBytes, size_t& next);
+
+    Outgoing truncatedReply(const Room& room, size_t resumeAt);
+
+    // Compresses a single frame reply when the client can inflate it and
+    // it is large enough to be worth it, false if it was left as it is
+    bool compress(Outgoing& out);
+
+    // compress for a push of the room's messages from..next. Subscribers
+    // at the same state push the same bytes, the room keeps the last one
+    // compressed for them.
+    void compressPush(const Room& room, size_t from, size_t next, Outgoing& out);
+
+    void onSubscribe(const Message&);
+
+    void replySubscribe();
+
+    typedef boost::shared_ptr<Room> RoomPtr;
+
+    // A room this connection gets pushes from and how far they got
+    struct Membership {
+        RoomPtr room;
+        size_t pushState;
+        // Skipped ahead, the next push starts with a truncated_reply
+        bool skipped;
+        // In the room's subscribers
+        SlotMap<Ptr>::Id subscription;
+    };
+
+    void join(const RoomPtr& room, size_t state);
+
+    std::vector<Membership>::iterator findMembership(const Room& room);
+
+    void onJoin(const Message&);
+
+    void onLeave(const Message&);
+
+    void onRoomSend(const Message&);
+
+    void onRoomFetchRange(const Message&);
+
+    void onSend(const Message&);
 
     void replySend();
 
-    void onLogout(Message);
+    void onSendBatch(const Message&);
+
+    void onLogout(const Message&);
+
+    void onHeartbeat(const Message&);
+
+    // A chunk request waiting for its data to be written to the receiver
+    struct PendingChunk {
+        u_int32_t corrID;
+        std::chrono::steady_clock::time_point started;
+    };
+
+    // A stream this connection sends or receives
+    struct Stream {
+        boost::weak_ptr<Connection> peer;
+        bool sending;
+        // Sending end only, the chunks not yet written to the receiver
+        std::deque<PendingChunk> pending;
+    };
+
+    void onStreamOpen(const Message&);
+
+    void onStreamChunk(const Message&);
+
+    void onStreamClose(const Message&);
+
+    // The rest run on this connection's service, posted by the other end
+    void acceptStream(u_int32_t id, const Ptr& sender, const std::string& from, const std::string& description);
+
+    void forwardChunk(u_int32_t id, const Message& chunk);
+
+    // The receiver wrote a chunk, answers the oldest chunk request
+    void chunkWritten(u_int32_t id);
+
+    void closeStream(u_int32_t id, u_int32_t status);
+
+    // Answers the stream's waiting chunk requests with status
+    void answerChunks(u_int32_t id, Stream& stream, u_int32_t status);
+
+    void answerChunk(u_int32_t id, const PendingChunk& pending, u_int32_t status);
+
+    void pushStream(const Message& m, u_int32_t id = 0);
+
+    // Applies the slow consumer policy to every room this connection is too
+    // far behind in, false if it was disconnected
+    bool checkLag();
     ///////////////////////////////////////////////////////////////////////////////////////
 
-    void doReadHeader();
+    void doRead();
+
+    // Handles every complete request in inBuffer, replies are written
+    // together once the whole batch is handled
+    void processInput();
+
+    // Writes a reply to the request being handled
+    void doWrite(Message m);
+
+    void doWrite(Outgoing&& out);
 
-    void doReadBody(Message m);
+    // Queues out as it is, a reply already carries its request's corrID,
+    // type and start
+    void queueWrite(Outgoing&& out);
+
+    void startWrite();
+
+    void setCork(bool on);
+
+    // Too much queued to take more requests or pushes
+    bool backlogged() const;
+
+    // Drained enough to start reading again
+    bool drained() const;
+
+    io_service& service_;
+    size_t shard;
+    SlotMap<Ptr>::Id id;
 
-    void doWrite(const Message m);
     ip::tcp::socket socket_;
 
+    // Requests keep being read while earlier replies are still being
+    // written, up to MAX_PIPELINE of them
+    enum {
+        MAX_PIPELINE = 64,
+        IN_BUFFER_SIZE = 16384
+    };
+
+    std::vector<char> inBuffer;
+    size_t inStart;
+    size_t inEnd;
+    bool batching;
+
+    Message readMsg;
+    u_int32_t corrID;
+    size_t pendingReplies;
+    bool readPaused;
+
     bool isStarted;
 
     std::string username;
+    bool compression;
     
-    typedef void(Connection::*Handler)(Message);
-    typedef std::vector<Handler> HandlersVector;
+    typedef void(Connection::*Handler)(const Message&);
 
-    HandlersVector handlers;
+    enum {
+        // Request types are odd, type / 2 indexes HANDLERS
+        HANDLERS_SIZE = Message::stream_close_request / 2 + 1
+    };
+
+    static const Handler HANDLERS[HANDLERS_SIZE];
+
+    //////////////////////////////
+    // Outgoing
+    // Everything queued while a write is in flight goes out with the next
+    // one as a single gathered write
+    enum {
+        // Buffers asio passes to one sendmsg call
+        MAX_IOV = 64,
+        // Emptied Outgoings kept for reuse
+        MAX_SPARE = 16
+    };
+
+    // Only pointers into writeBuffers, asio copies the sequence it's given
+    struct BufferView {
+        typedef const_buffer value_type;
+        typedef std::vector<const_buffer>::const_iterator const_iterator;
+
+        const_iterator begin() const {
+            return first;
+        }
+
+        const_iterator end() const {
+            return last;
+        }
+
+        const_iterator first;
+        const_iterator last;
+    };
+
+    std::vector<Outgoing> writeQueue;
+    std::vector<Outgoing> writeBatch;
+    std::vector<const_buffer> writeBuffers;
+    std::vector<Outgoing> spareOutgoing;
+    // A read is always in flight, its handler lives here
+    HandlerMemory readMemory;
+    // Written on the shard's thread, read by the stats from any
+    std::atomic<size_t> queuedBytes;
+    size_t queuedFrames;
+    bool writing;
+    std::atomic<long long> writeCounter;
+    std::atomic<long long> frameCounter;
+    std::atomic<long long> compressedBytes;
+    std::atomic<long long> compressedSaved;
+
+    // The lobby is one of the memberships once subscribed
+    RoomPtr lobby;
+    std::vector<Membership> memberships;
+    bool pushing;
+    // A push waited for the queue to drain
+    bool pushHeld;
+    // Set by rooms posting pushMessages, cleared when it runs
+    std::atomic<bool> pushPosted;
+
+    //////////////////////////////
+    // Streams
+    // Chunks a sender may have waiting, each is at most a MAX_LENGTH frame
+    // in the receiver's write queue
+    enum {
+        STREAM_WINDOW = 16,
+        MAX_STREAMS = 8
+    };
+
+    std::unordered_map<u_int32_t, Stream> streams;
 
     //////////////////////////////
     // Timers
-    long long allTime;
-    long long requestCounter;
-    boost::posix_time::ptime current;
+    // Set on the shard's thread once the connection is in its wheel
+    Timers* timers;
+    Timers::Tick lastRead;
+    Timers::Tick writeStarted;
 
-    void startRequest();
+    void armTimeouts();
 
-    void completeRequest();
+    std::chrono::steady_clock::time_point current;
+    u_int32_t currentType;
 
-    /////////////////////////////////////////
-    //Synchronization
-    mutable boost::recursive_mutex userMutex;
+    void startRequest();
 
+    // Records the time since the request was read
+    void completeRequest(const Outgoing& reply);
 };
 
 #endif	/* CONNECTION_HPP */
@@ -0,0 +1,89 @@
+/*
+ * File:   Counters.hpp
+ * Author: stels
+ *
+ * Created on December 18, 2013, 1:10 PM
+ */
+
+#ifndef COUNTERS_HPP
+#define	COUNTERS_HPP
+
+#include <cstdlib>
+#include <sys/types.h>
+#include <atomic>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+
+// Totals since the server started. Like Latency every thread counts into
+// a shard of its own without any lock, readers add the shards up.
+class Counters : boost::noncopyable {
+public:
+
+    enum Counter {
+        ACCEPTS, BYTES_IN, BYTES_OUT,
+        // Backpressure: reads stopped on a full write queue, messages slow
+        // subscribers never got and slow subscribers cut off
+        READ_PAUSES, SLOW_DROPPED, SLOW_SKIPPED, SLOW_DISCONNECTS,
+        // Connections closed for sending nothing or not taking a write
+        IDLE_TIMEOUTS, WRITE_TIMEOUTS,
+        // Stream payload forwarded to receivers
+        STREAM_BYTES,
+        // Joins with maxRooms rooms in use
+        ROOMS_REFUSED,
+        COUNTERS
+    };
+
+    enum {
+        // Request types are odd and below 2 * TYPES
+        TYPES = 16
+    };
+
+    static void add(Counter counter, u_int64_t n) {
+        bump(shard().counters[counter], n);
+    }
+
+    static void request(u_int32_t requestType) {
+        if ((requestType >> 1) < TYPES) {
+            bump(shard().requests[requestType >> 1], 1);
+        }
+    }
+
+    static u_int64_t get(Counter counter);
+
+    static u_int64_t getRequests(u_int32_t requestType);
+
+private:
+
+    Counters() {
+    }
+
+    struct Shard {
+
+        Shard() {
+            for (auto& c : counters) {
+                c.store(0, std::memory_order_relaxed);
+            }
+            for (auto& c : requests) {
+                c.store(0, std::memory_order_relaxed);
+            }
+        }
+
+        std::atomic<u_int64_t> counters[COUNTERS];
+        std::atomic<u_int64_t> requests[TYPES];
+    };
+
+    // Only the owning thread writes, so a plain load and store will do
+    static void bump(std::atomic<u_int64_t>& counter, u_int64_t n) {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    static Shard& shard();
+
+    static std::vector<Shard*> shards;
+    static boost::mutex shardsMutex;
+};
+
+#endif	/* COUNTERS_HPP */
+
@@ -0,0 +1,116 @@
+/*
+ * File:   HandlerMemory.hpp
+ * Author: stels
+ *
+ * Created on December 22, 2013, 11:40 AM
+ */
+
+#ifndef HANDLERMEMORY_HPP
+#define	HANDLERMEMORY_HPP
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include <boost/noncopyable.hpp>
+
+// Room for one handler's operation at a time. asio keeps a single block
+// per thread for reuse, a connection with a read and a write in flight
+// misses it on every other operation. Too large a handler falls back to
+// the heap.
+class HandlerMemory : private boost::noncopyable {
+public:
+
+    HandlerMemory() : inUse(false) {
+    }
+
+    void* allocate(size_t size) {
+        if (!inUse && size <= sizeof (storage)) {
+            inUse = true;
+            return &storage;
+        }
+        return ::operator new(size);
+    }
+
+    void deallocate(void* p) {
+        if (p == &storage) {
+            inUse = false;
+        } else {
+            ::operator delete(p);
+        }
+    }
+
+private:
+
+    enum {
+        SIZE = 512
+    };
+
+    std::aligned_storage<SIZE>::type storage;
+    bool inUse;
+};
+
+// The allocator asio finds through a handler's allocator_type
+template <typename T>
+class HandlerAllocator {
+public:
+    typedef T value_type;
+
+    explicit HandlerAllocator(HandlerMemory& memory) : memory(memory) {
+    }
+
+    template <typename U>
+    HandlerAllocator(const HandlerAllocator<U>& other) : memory(other.memory) {
+    }
+
+    T* allocate(size_t n) const {
+        return static_cast<T*> (memory.allocate(sizeof (T) * n));
+    }
+
+    void deallocate(T* p, size_t) const {
+        return memory.deallocate(p);
+    }
+
+    bool operator==(const HandlerAllocator& other) const {
+        return &memory == &other.memory;
+    }
+
+    bool operator!=(const HandlerAllocator& other) const {
+        return &memory != &other.memory;
+    }
+
+private:
+    template <typename> friend class HandlerAllocator;
+
+    HandlerMemory& memory;
+};
+
+template <typename Handler>
+class MemoryHandler {
+public:
+    typedef HandlerAllocator<Handler> allocator_type;
+
+    MemoryHandler(HandlerMemory& memory, Handler handler) : memory(memory), handler(std::move(handler)) {
+    }
+
+    allocator_type get_allocator() const {
+        return allocator_type(memory);
+    }
+
+    template <typename... Args>
+    void operator()(Args&&... args) {
+        handler(std::forward<Args>(args)...);
+    }
+
+private:
+    HandlerMemory& memory;
+    Handler handler;
+};
+
+template <typename Handler>
+MemoryHandler<Handler> makeHandler(HandlerMemory& memory, Handler handler) {
+    return MemoryHandler<Handler>(memory, std::move(handler));
+}
+
+#endif	/* HANDLERMEMORY_HPP */
@@ -0,0 +1,144 @@
+/*
+ * File:   Histogram.hpp
+ * Author: stels
+ *
+ * Created on December 17, 2013, 3:05 PM
+ */
+
+#ifndef HISTOGRAM_HPP
+#define	HISTOGRAM_HPP
+
+#include <cstdlib>
+#include <sys/types.h>
+#include <atomic>
+#include <algorithm>
+
+// Log-linear buckets in the manner of HdrHistogram: values below
+// SUB_BUCKETS get a bucket each, above that every power of two is split
+// into SUB_BUCKETS / 2 equal buckets, so a value is recorded to within 3%
+// at any magnitude. Only one thread may record, any thread may read.
+class Histogram {
+public:
+
+    enum {
+        SUB_BUCKET_BITS = 6,
+        SUB_BUCKETS = 1 << SUB_BUCKET_BITS,
+        HALF = SUB_BUCKETS / 2,
+        // Values are clamped below 2^MAX_BITS
+        MAX_BITS = 40,
+        BUCKETS = SUB_BUCKETS + (MAX_BITS - SUB_BUCKET_BITS) * HALF
+    };
+
+    Histogram() : total(0), sum(0), max(0) {
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            counts[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    Histogram(const Histogram& other) : Histogram() {
+        add(other);
+    }
+
+    void record(u_int64_t value) {
+        value = std::min<u_int64_t>(value, (1ULL << MAX_BITS) - 1);
+        bump(counts[bucket(value)], 1);
+        bump(total, 1);
+        bump(sum, value);
+        if (value > max.load(std::memory_order_relaxed)) {
+            max.store(value, std::memory_order_relaxed);
+        }
+    }
+
+    // Recording thread only
+    void reset() {
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            counts[i].store(0, std::memory_order_relaxed);
+        }
+        total.store(0, std::memory_order_relaxed);
+        sum.store(0, std::memory_order_relaxed);
+        max.store(0, std::memory_order_relaxed);
+    }
+
+    // Not atomic as a whole, counts recorded meanwhile may be half in
+    void add(const Histogram& other) {
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            bump(counts[i], other.counts[i].load(std::memory_order_relaxed));
+        }
+        bump(total, other.total.load(std::memory_order_relaxed));
+        bump(sum, other.sum.load(std::memory_order_relaxed));
+        max.store(std::max(max.load(std::memory_order_relaxed), other.max.load(std::memory_order_relaxed)),
+                std::memory_order_relaxed);
+    }
+
+    u_int64_t count() const {
+        return total.load(std::memory_order_relaxed);
+    }
+
+    u_int64_t getSum() const {
+        return sum.load(std::memory_order_relaxed);
+    }
+
+    u_int64_t getMax() const {
+        return max.load(std::memory_order_relaxed);
+    }
+
+    double mean() const {
+        return count() > 0 ? static_cast<double> (getSum()) / count() : 0;
+    }
+
+    // Largest value in the bucket holding the p-th fraction of the values
+    u_int64_t percentile(double p) const {
+        u_int64_t rank = static_cast<u_int64_t> (p * count() + 0.5);
+        u_int64_t seen = 0;
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            seen += counts[i].load(std::memory_order_relaxed);
+            if (seen >= std::max<u_int64_t>(rank, 1)) {
+                return std::min(highest(i), getMax());
+            }
+        }
+        return getMax();
+    }
+
+    // Values up to bucketLimit(i) land in buckets up to i, for exporting
+    // cumulative buckets
+    static u_int64_t bucketLimit(size_t i) {
+        return highest(i);
+    }
+
+    u_int64_t bucketCount(size_t i) const {
+        return counts[i].load(std::memory_order_relaxed);
+    }
+
+private:
+
+    Histogram& operator=(const Histogram&);
+
+    static void bump(std::atomic<u_int64_t>& counter, u_int64_t n) {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    static size_t bucket(u_int64_t value) {
+        if (value < SUB_BUCKETS) {
+            return value;
+        }
+        size_t shift = 63 - __builtin_clzll(value) - (SUB_BUCKET_BITS - 1);
+        return SUB_BUCKETS + (shift - 1) * HALF + (value >> shift) - HALF;
+    }
+
+    static u_int64_t highest(size_t i) {
+        if (i < SUB_BUCKETS) {
+            return i;
+        }
+        size_t shift = (i - SUB_BUCKETS) / HALF + 1;
+        u_int64_t low = static_cast<u_int64_t> ((i - SUB_BUCKETS) % HALF + HALF) << shift;
+        return low + (1ULL << shift) - 1;
+    }
+
+    std::atomic<u_int64_t> counts[BUCKETS];
+    std::atomic<u_int64_t> total;
+    std::atomic<u_int64_t> sum;
+    std::atomic<u_int64_t> max;
+};
+
+#endif	/* HISTOGRAM_HPP */
+
@@ -0,0 +1,144 @@
+/*
+ * File:   HistoryFile.hpp
+ * Author: stels
+ *
+ * Created on December 9, 2013, 4:37 PM
+ */
+
+#ifndef HISTORYFILE_HPP
+#define	HISTORYFILE_HPP
+
+#include <cstdlib>
+#include <sys/types.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+
+#include "../../Core/Message.hpp"
+
+// Append-only history on disk, kept as two memory mapped files:
+//
+//   <path>.log  fetch_reply frames exactly as they go on the wire
+//   <path>.idx  a small header followed by one (offset, length) entry per
+//               message, entry i locates message i in the log
+//
+// Both files are mapped once over a large reserved range and grown with
+// ftruncate, so appends and reads never remap and never take a lock.
+// Writers reserve log bytes with a fetch_add and may finish out of order,
+// an entry becomes valid once its length is stored.
+//
+// The header holds a checkpoint: the number of messages known to be on disk
+// and the end of their bytes. Reopening reads the checkpoint and validates
+// only the entries written after it, so restart time doesn't depend on the
+// size of the history.
+class HistoryFile : boost::noncopyable {
+public:
+
+    struct Config {
+
+        Config() : syncEvery(0), checkpointMillis(1000) {
+        }
+
+        // fdatasync after this many appends, 0 leaves it to checkpoints
+        size_t syncEvery;
+        size_t checkpointMillis;
+    };
+
+    // Opens or creates the files and recovers the messages written before
+    // the last shutdown or crash, throws std::runtime_error on failure
+    HistoryFile(const std::string& path, const Config& config);
+
+    ~HistoryFile();
+
+    // index must be the next one after every earlier append's, appends
+    // from several threads may complete in any order
+    void append(size_t index, const Message& frame);
+
+    // frames go to first and the indexes after it, with one reservation in
+    // the log file
+    void appendBatch(size_t first, const std::vector<Message>& frames);
+
+    // Copies a recovered or appended message, false while its append is
+    // still in progress
+    bool get(size_t index, Message& out) const;
+
+    // Messages recovered on open
+    size_t recovered() const {
+        return recoveredCount;
+    }
+
+    // Syncs both files and moves the checkpoint past every complete entry
+    void checkpoint();
+
+private:
+
+    struct Header {
+        char magic[8];
+        u_int64_t version;
+        u_int64_t count;
+        u_int64_t tail;
+    };
+
+    struct Entry {
+        std::atomic<u_int64_t> offset;
+        // Stored last, 0 while the entry is being written
+        std::atomic<u_int64_t> length;
+    };
+
+    enum {
+        FORMAT_VERSION = 1
+    };
+
+    // Reserved address space per file and the step the files grow by
+    static const u_int64_t MAX_LOG_BYTES = 1ULL << 36;
+    static const u_int64_t MAX_INDEX_BYTES = 1ULL << 32;
+    static const u_int64_t GROW_BYTES = 1ULL << 24;
+
+    static char* mapFile(int fd, u_int64_t reserve);
+
+    void recover();
+
+    bool validEntry(size_t i, u_int64_t size) const;
+
+    void ensureSize(int fd, std::atomic<u_int64_t>& size, u_int64_t needed, u_int64_t reserve);
+
+    // Copies the frame to offset, which is reserved, and publishes entry i
+    void write(size_t i, const Message& frame, u_int64_t offset);
+
+    // Syncs once syncEvery appends are made
+    void appended(size_t count);
+
+    void flusherThread();
+
+    Header& header() const {
+        return *reinterpret_cast<Header*> (index);
+    }
+
+    Entry& entry(size_t i) const {
+        return reinterpret_cast<Entry*> (index + sizeof (Header))[i];
+    }
+
+    Config config;
+
+    int logFd;
+    int indexFd;
+    char* log;
+    char* index;
+
+    std::atomic<u_int64_t> logSize;
+    std::atomic<u_int64_t> indexSize;
+    std::atomic<u_int64_t> tail;
+    std::atomic<size_t> unsynced;
+    boost::mutex growMutex;
+    boost::mutex checkpointMutex;
+
+    size_t recoveredCount;
+    boost::thread flusher;
+};
+
+#endif	/* HISTORYFILE_HPP */
+
@@ -0,0 +1,56 @@
+/*
+ * File:   Latency.hpp
+ * Author: stels
+ *
+ * Created on December 17, 2013, 3:40 PM
+ */
+
+#ifndef LATENCY_HPP
+#define	LATENCY_HPP
+
+#include <cstdlib>
+#include <sys/types.h>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+
+#include "Histogram.hpp"
+
+// Request latencies in nanoseconds, from the moment a request is read
+// until its reply is written, by request type. Each thread records into
+// a shard of its own without any lock, readers merge the shards.
+class Latency : boost::noncopyable {
+public:
+
+    enum {
+        // Request types are odd and below 2 * TYPES
+        TYPES = 16
+    };
+
+    static void record(u_int32_t requestType, u_int64_t nanos);
+
+    static Histogram snapshot(u_int32_t requestType);
+
+    // Every type merged
+    static Histogram snapshot();
+
+private:
+
+    Latency() {
+    }
+
+    struct Shard {
+        Histogram histograms[TYPES];
+    };
+
+    static Shard& shard();
+
+    // Shards belong to threads that run until the process exits, they are
+    // never freed
+    static std::vector<Shard*> shards;
+    static boost::mutex shardsMutex;
+};
+
+#endif	/* LATENCY_HPP */
+
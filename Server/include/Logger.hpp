@@ -0,0 +1,88 @@
+/*
+ * File:   Logger.hpp
+ * Author: stels
+ *
+ * Created on December 16, 2013, 11:20 AM
+ */
+
+#ifndef LOGGER_HPP
+#define	LOGGER_HPP
+
+#include <cstdlib>
+#include <atomic>
+#include <memory>
+#include <iostream>
+#include <string>
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+
+// Console output from the io threads. Lines go into a bounded lock-free
+// queue and a thread of its own writes them out in batches, one flush per
+// batch, so a slow terminal or pipe never holds up a request. When the
+// queue is full lines are dropped and counted, or the writer waits,
+// depending on the policy.
+class Logger : boost::noncopyable {
+public:
+
+    enum Policy {
+        DROP, BLOCK
+    };
+
+    struct Config {
+
+        Config() : capacity(8192), policy(DROP) {
+        }
+
+        // Rounded up to a power of two
+        size_t capacity;
+        Policy policy;
+    };
+
+    static void start(const Config& config, std::ostream& os = std::cout);
+
+    // Writes whatever is queued and stops the thread
+    static void stop();
+
+    // Written straight away until the logger is started
+    static void log(std::string line);
+
+    static size_t getDropped();
+
+    // Lines waiting for the writer
+    static size_t getQueued();
+
+private:
+
+    Logger() {
+    }
+
+    enum {
+        BATCH = 256
+    };
+
+    // A slot is free for the producer at position pos when seq == pos, and
+    // holds a line for the consumer when seq == pos + 1
+    struct Slot {
+        std::atomic<size_t> seq;
+        std::string line;
+    };
+
+    static bool pop(std::string& line);
+
+    static void writerThread();
+
+    static Config config;
+    static std::ostream* out;
+    static std::unique_ptr<Slot[]> ring;
+    static size_t mask;
+    static std::atomic<size_t> tail;
+    // Only the writer moves head, others just read it
+    static std::atomic<size_t> head;
+    static std::atomic<bool> running;
+    static std::atomic<size_t> dropped;
+    static boost::thread writer;
+};
+
+#endif	/* LOGGER_HPP */
+
@@ -0,0 +1,306 @@
+/*
+ * File:   MessageLog.hpp
+ * Author: stels
+ *
+ * Created on December 2, 2013, 6:12 PM
+ */
+
+#ifndef MESSAGELOG_HPP
+#define	MESSAGELOG_HPP
+
+#include <cstdlib>
+#include <atomic>
+#include <algorithm>
+#include <vector>
+#include <new>
+#include <type_traits>
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+
+// Append-only log split into fixed size segments that are never moved or
+// reallocated. Writers reserve a sequence number with a single fetch_add,
+// fill their slot and mark it ready. Whichever writer finds the entry at
+// the published size ready moves it past the whole ready run, so nobody
+// waits on a slower writer. Readers only load the published size, every
+// entry below it is immutable and safe to read without any lock.
+//
+// Only a window of the newest entries is kept. Segments sit in a ring and
+// the oldest ones are dropped by trim, or when the ring wraps around.
+// Slots are plain atomic pointers. A reader counts itself on the segment
+// and then checks the slot still holds it, a dropped segment is only
+// cleared and reused once no reader is counted on it, so get just fails
+// for indexes below first().
+template <typename T>
+class MessageLog : boost::noncopyable {
+public:
+
+    enum {
+        SEGMENT_BITS = 12,
+        SEGMENT_SIZE = 1 << SEGMENT_BITS,
+        RING_SEGMENTS = 1 << 16
+    };
+
+    // At most ringSegments segments are ever kept
+    explicit MessageLog(size_t ringSegments = RING_SEGMENTS) : reserved(0), published(0), first_(0), bytes_(0),
+    ring(std::max<size_t>(ringSegments, 4)) {
+        for (size_t i = 0; i < ring.size(); ++i) {
+            ring[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    ~MessageLog() {
+        for (size_t i = 0; i < ring.size(); ++i) {
+            delete ring[i].load(std::memory_order_relaxed);
+        }
+        for (size_t i = 0; i < retired.size(); ++i) {
+            delete retired[i];
+        }
+        for (size_t i = 0; i < spares.size(); ++i) {
+            delete spares[i];
+        }
+    }
+
+    // bytes is what the entry counts against trim's maxBytes
+    size_t append(const T& value, size_t bytes = 0) {
+        size_t seq = reserved.fetch_add(1, std::memory_order_relaxed);
+        Segment* segment = getSegment(seq >> SEGMENT_BITS);
+        new (&segment->entries[seq & (SEGMENT_SIZE - 1)]) T(value);
+        segment->bytes.fetch_add(bytes, std::memory_order_relaxed);
+        segment->ready[seq & (SEGMENT_SIZE - 1)].store(true, std::memory_order_seq_cst);
+        // Last touch of the segment, reclaim waits until every entry counts
+        segment->constructed.fetch_add(1, std::memory_order_release);
+        bytes_.fetch_add(bytes, std::memory_order_relaxed);
+        publish();
+        return seq;
+    }
+
+    // Appends values as consecutive entries with a single reservation and
+    // publishes them together, returns the first one's index. bytes(value)
+    // is what each counts against trim's maxBytes.
+    template <typename F>
+    size_t appendBatch(const std::vector<T>& values, F bytes) {
+        size_t count = values.size();
+        size_t seq = reserved.fetch_add(count, std::memory_order_relaxed);
+        if (count == 0) {
+            return seq;
+        }
+        Segment* head = getSegment(seq >> SEGMENT_BITS);
+        Segment* segment = head;
+        size_t total = 0;
+        for (size_t i = 0; i < count; ++i) {
+            size_t s = seq + i;
+            if (segment->number.load(std::memory_order_relaxed) != s >> SEGMENT_BITS) {
+                segment = getSegment(s >> SEGMENT_BITS);
+            }
+            new (&segment->entries[s & (SEGMENT_SIZE - 1)]) T(values[i]);
+            size_t b = bytes(values[i]);
+            segment->bytes.fetch_add(b, std::memory_order_relaxed);
+            total += b;
+            // The first entry goes ready last, nothing is published before it
+            if (i > 0) {
+                segment->ready[s & (SEGMENT_SIZE - 1)].store(true, std::memory_order_seq_cst);
+                segment->constructed.fetch_add(1, std::memory_order_release);
+            }
+        }
+        head->ready[seq & (SEGMENT_SIZE - 1)].store(true, std::memory_order_seq_cst);
+        head->constructed.fetch_add(1, std::memory_order_release);
+        bytes_.fetch_add(total, std::memory_order_relaxed);
+        publish();
+        return seq;
+    }
+
+    size_t size() const {
+        return published.load(std::memory_order_acquire);
+    }
+
+    // Oldest index still kept
+    size_t first() const {
+        return first_.load(std::memory_order_acquire);
+    }
+
+    // Bytes of the entries kept
+    size_t bytes() const {
+        return bytes_.load(std::memory_order_relaxed);
+    }
+
+    // Copies the entry at index, false if it has been dropped. index must
+    // be below a value returned by size().
+    bool get(size_t index, T& out) const {
+        size_t n = index >> SEGMENT_BITS;
+        const std::atomic<Segment*>& slot = ring[n % ring.size()];
+        Segment* segment = slot.load(std::memory_order_acquire);
+        if (!segment) {
+            return false;
+        }
+        // Counted before the slot is checked again, so drop either sees the
+        // reader or the reader sees the slot changed
+        segment->readers.fetch_add(1, std::memory_order_seq_cst);
+        bool kept = slot.load(std::memory_order_seq_cst) == segment &&
+                segment->number.load(std::memory_order_relaxed) == n;
+        if (kept) {
+            out = reinterpret_cast<const T&> (segment->entries[index & (SEGMENT_SIZE - 1)]);
+        }
+        segment->readers.fetch_sub(1, std::memory_order_release);
+        return kept;
+    }
+
+    // Drops the oldest whole segments while more than maxCount entries or
+    // maxBytes are kept. The segment being filled always stays.
+    void trim(size_t maxCount, size_t maxBytes) {
+        if (size() - first() <= maxCount && bytes() <= maxBytes) {
+            return;
+        }
+        boost::mutex::scoped_lock lock(trimMutex);
+        size_t newest = size() >> SEGMENT_BITS;
+        size_t n = first() >> SEGMENT_BITS;
+        while (n < newest && (size() - first() > maxCount || bytes() > maxBytes)) {
+            drop(n++);
+        }
+    }
+
+private:
+
+    // Slots are constructed only when appended. A segment is never freed
+    // before the log, a late reader only ever touches its counter.
+    struct Segment : boost::noncopyable {
+
+        Segment() : number(0), readers(0), constructed(0), bytes(0) {
+            for (size_t i = 0; i < SEGMENT_SIZE; ++i) {
+                ready[i].store(false, std::memory_order_relaxed);
+            }
+        }
+
+        ~Segment() {
+            clear();
+        }
+
+        void clear() {
+            for (size_t i = 0; i < SEGMENT_SIZE; ++i) {
+                if (ready[i].load(std::memory_order_relaxed)) {
+                    reinterpret_cast<T&> (entries[i]).~T();
+                    ready[i].store(false, std::memory_order_relaxed);
+                }
+            }
+            constructed.store(0, std::memory_order_relaxed);
+            bytes.store(0, std::memory_order_relaxed);
+        }
+
+        std::atomic<size_t> number;
+        std::atomic<size_t> readers;
+        std::atomic<size_t> constructed;
+        std::atomic<size_t> bytes;
+        std::atomic<bool> ready[SEGMENT_SIZE];
+        typename std::aligned_storage<sizeof (T), alignof (T)>::type entries[SEGMENT_SIZE];
+    };
+
+    // Moves the published size past the entries ready at it. A writer marks
+    // its entry before looking at the size and this looks at the entry after
+    // moving the size, so one of them always sees the other.
+    void publish() {
+        size_t from = published.load(std::memory_order_seq_cst);
+        for (;;) {
+            size_t to = from;
+            while (isReady(to)) {
+                ++to;
+            }
+            if (to == from) {
+                return;
+            }
+            if (published.compare_exchange_strong(from, to, std::memory_order_seq_cst)) {
+                from = to;
+            }
+        }
+    }
+
+    bool isReady(size_t seq) const {
+        size_t n = seq >> SEGMENT_BITS;
+        Segment* segment = ring[n % ring.size()].load(std::memory_order_acquire);
+        return segment && segment->number.load(std::memory_order_relaxed) == n &&
+                segment->ready[seq & (SEGMENT_SIZE - 1)].load(std::memory_order_seq_cst);
+    }
+
+    Segment* getSegment(size_t n) {
+        std::atomic<Segment*>& slot = ring[n % ring.size()];
+        Segment* segment = slot.load(std::memory_order_acquire);
+        if (segment && segment->number.load(std::memory_order_relaxed) == n) {
+            return segment;
+        }
+        if (n >= ring.size()) {
+            // Wrapped around. The segment replaced must be published first,
+            // it may hold an entry publishing still waits on.
+            for (int spins = 0; size() < (n - ring.size() + 1) << SEGMENT_BITS; ++spins) {
+                if (spins > 64) {
+                    boost::this_thread::yield();
+                }
+            }
+        }
+        // Slots only change under the lock, a pointer loaded before it may
+        // already be reused
+        boost::mutex::scoped_lock lock(trimMutex);
+        for (size_t k = first() >> SEGMENT_BITS; k + ring.size() <= n; ++k) {
+            drop(k);
+        }
+        segment = slot.load(std::memory_order_relaxed);
+        if (!segment || segment->number.load(std::memory_order_relaxed) < n) {
+            segment = spare();
+            segment->number.store(n, std::memory_order_relaxed);
+            slot.store(segment, std::memory_order_release);
+        }
+        return segment;
+    }
+
+    // Called under trimMutex for the oldest segment kept
+    void drop(size_t n) {
+        std::atomic<Segment*>& slot = ring[n % ring.size()];
+        Segment* segment = slot.load(std::memory_order_acquire);
+        first_.store((n + 1) << SEGMENT_BITS, std::memory_order_release);
+        if (segment && segment->number.load(std::memory_order_relaxed) == n) {
+            bytes_.fetch_sub(segment->bytes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            slot.store(nullptr, std::memory_order_seq_cst);
+            retired.push_back(segment);
+        }
+        reclaim();
+    }
+
+    // Called under trimMutex. Clears the retired segments no reader or
+    // writer is still on.
+    void reclaim() {
+        size_t kept = 0;
+        for (size_t i = 0; i < retired.size(); ++i) {
+            Segment* segment = retired[i];
+            if (segment->readers.load(std::memory_order_seq_cst) == 0 &&
+                    segment->constructed.load(std::memory_order_acquire) == SEGMENT_SIZE) {
+                segment->clear();
+                spares.push_back(segment);
+            } else {
+                retired[kept++] = segment;
+            }
+        }
+        retired.resize(kept);
+    }
+
+    // Called under trimMutex
+    Segment* spare() {
+        reclaim();
+        if (spares.empty()) {
+            return new Segment();
+        }
+        Segment* segment = spares.back();
+        spares.pop_back();
+        return segment;
+    }
+
+    std::atomic<size_t> reserved;
+    std::atomic<size_t> published;
+    std::atomic<size_t> first_;
+    std::atomic<size_t> bytes_;
+    boost::mutex trimMutex;
+    std::vector<std::atomic<Segment*> > ring;
+    // Dropped segments still being read, and cleared ones to reuse
+    std::vector<Segment*> retired;
+    std::vector<Segment*> spares;
+};
+
+#endif	/* MESSAGELOG_HPP */
+
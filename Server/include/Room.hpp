@@ -0,0 +1,117 @@
+/*
+ * File:   Room.hpp
+ * Author: stels
+ *
+ * Created on December 11, 2013, 2:15 PM
+ */
+
+#ifndef ROOM_HPP
+#define	ROOM_HPP
+
+#include <cstdlib>
+#include <atomic>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include "../../Core/Message.hpp"
+#include "SlotMap.hpp"
+#include "MessageLog.hpp"
+#include "HistoryFile.hpp"
+
+class Connection;
+
+// A channel with its own history and subscribers. Message numbers are per
+// room and nothing is shared between rooms, so rooms busy on different
+// shards never touch the same cache lines.
+class Room : boost::noncopyable {
+public:
+    typedef boost::shared_ptr<Connection> Ptr;
+
+    // Keeps at most windowCount messages or windowBytes in memory. Older
+    // messages are read from history when it is given, the room owns it.
+    Room(const std::string& name, size_t windowCount, size_t windowBytes, HistoryFile* history = nullptr);
+
+    const std::string& getName() const {
+        return name;
+    }
+
+    void addMessage(const std::string& msg);
+
+    // Appends msgs as consecutive messages in one go and wakes subscribers
+    // once, returns the index the first one got
+    size_t addMessages(const std::vector<std::string>& msgs);
+
+    // History entries are stored as ready to send fetch_reply frames which
+    // are shared by every connection writing them. false once the message
+    // has left the window and can't be read from the history file.
+    bool getMessage(size_t index, Message& out) const;
+
+    size_t getMessages(size_t from, size_t maxCount, size_t maxBytes, std::vector<Message>& out) const;
+
+    size_t getMessagesSize() const;
+
+    // Oldest message a fetch can still get
+    size_t getFirstMessage() const;
+
+    // Bytes held by the in-memory window
+    size_t getWindowBytes() const;
+
+    // Puts what has been appended so far on disk
+    void sync();
+
+    // The id unsubscribes
+    SlotMap<Ptr>::Id subscribe(const Ptr& p);
+
+    void unsubscribe(SlotMap<Ptr>::Id id);
+
+    // The push of messages from..next last compressed by a subscriber,
+    // false if the last one covered another range. Pushes carry corrID 0,
+    // the frame is sent as it is by every subscriber at that state.
+    bool findCompressed(size_t from, size_t next, Message& out) const;
+
+    void keepCompressed(size_t from, size_t next, const Message& frame) const;
+
+    // Names are a single word of printable characters
+    static bool validName(boost::string_ref name);
+
+private:
+
+    void notifySubscribers();
+
+    bool persisting() const;
+
+    // A failed append leaves the history file with what came before index,
+    // later messages are only kept in the window
+    void stopPersisting(size_t index, const std::exception& e);
+
+    const std::string name;
+
+    // Messages recovered from the history file keep their indexes and are
+    // read from the mapping, messages sent since the start follow them
+    MessageLog<Message> messages;
+    boost::scoped_ptr<HistoryFile> history;
+    size_t historyBase;
+    // Messages from here on aren't in the history file, NO_END while it
+    // takes every one
+    std::atomic<size_t> historyEnd;
+    size_t windowCount;
+    size_t windowBytes;
+
+    SlotMap<Ptr> subscribers;
+    boost::mutex subscribersMutex;
+
+    // Subscribers on every shard share it, one deflate per range
+    mutable size_t compressedFrom;
+    mutable size_t compressedNext;
+    mutable Message compressedFrame;
+    mutable boost::mutex compressedMutex;
+};
+
+#endif	/* ROOM_HPP */
+
@@ -18,6 +18,7 @@
 #include <fstream>
 #include <string>
 #include <utility>
+#include <atomic>
 
 #include <boost/range/numeric.hpp>
 #include <boost/range/adaptor/transformed.hpp>
@@ -29,58 +30,195 @@
 #include <boost/enable_shared_from_this.hpp>
 #include "boost/date_time/posix_time/posix_time.hpp"
 #include <boost/thread.hpp>
+#include <boost/scoped_ptr.hpp>
 
 #include "Connection.hpp"
+#include "HistoryFile.hpp"
+#include "Room.hpp"
+#include "Logger.hpp"
+#include "Latency.hpp"
+#include "Counters.hpp"
+#include "Admin.hpp"
+#include "Allocations.hpp"
 
 
 class Server : boost::noncopyable {
 public:
     typedef boost::shared_ptr<Connection> Ptr;
-    typedef std::vector<Ptr> UserList;
 
-    enum {
-        THREADS_NUM = 5
+    struct Config {
+
+        Config() : port(33333), threads(boost::thread::hardware_concurrency()), pinThreads(true),
+        historyPath("history"), windowCount(1 << 20), windowBytes(256 << 20), maxRooms(1024), compressThreshold(512),
+        adminPort(33334), limits() {
+        }
+
+        unsigned short port;
+        // One io_service, acceptor and thread per shard
+        size_t threads;
+        // Bind shard i's thread to cpu i
+        bool pinThreads;
+        // Files the lobby's history is kept in across restarts, empty keeps
+        // it in memory only
+        std::string historyPath;
+        HistoryFile::Config history;
+        // Caps on the messages each room keeps in memory, older ones are
+        // read from the history file or answered with truncated_reply
+        size_t windowCount;
+        size_t windowBytes;
+        // Rooms besides the lobby, joining another fails once they're all
+        // taken by rooms someone is in or has written to
+        size_t maxRooms;
+        // Replies to clients that can inflate are compressed from this many
+        // body bytes on, 0 never compresses
+        size_t compressThreshold;
+        Logger::Config log;
+        // Serves /metrics on 127.0.0.1, 0 turns it off
+        unsigned short adminPort;
+        Connection::Limits limits;
     };
     
-    static void listenThread();
-    
-    static void addMessage(const std::string& msg);
+    typedef boost::shared_ptr<Room> RoomPtr;
+
+    static const std::string LOBBY;
+
+    // The room everybody is in, the only one with a history file. Exists
+    // once the server is started.
+    static const RoomPtr& getLobby();
+
+    // Creates the room on first use, null for an invalid name or when
+    // there are maxRooms already
+    static RoomPtr getRoom(const std::string& name);
+
+    // Drops the room once nobody holds it and nothing was said in it
+    static void releaseRoom(const std::string& name);
+
+    // null if nobody ever joined the room
+    static RoomPtr findRoom(boost::string_ref name);
+
+    static void print(const std::string& room, const std::string& msg);
 
-    static std::string getMessage(size_t index);
+    static size_t getCompressThreshold();
 
-    static size_t getMessagesSize();
+    static const Connection::Limits& getLimits();
 
+    // The shard's timeouts, only to be used on its thread
+    static Connection::Timers& getTimers(size_t shard);
+
+    // Registers the connection with its shard and gives it its id
     static void startConnection(const Ptr& p);
 
     static void stopConnection(const Ptr& p);
 
+    // Logged in users by name for streams, the latest login of a name wins
+    static void addUser(const std::string& name, const Ptr& p);
+
+    static void removeUser(const std::string& name, const Ptr& p);
+
+    // null if nobody by that name is logged in
+    static Ptr findUser(boost::string_ref name);
+
+    // Ids of streams, unique over all connections
+    static u_int32_t nextStreamId();
+
+    // Calls f with every started connection, one shard locked at a time.
+    // f must not start or stop connections.
+    template <typename F>
+    static void forEachConnection(F f) {
+        for (const boost::shared_ptr<Shard>& shard : shards) {
+            boost::mutex::scoped_lock lock(shard->usersMutex);
+            for (const Ptr& p : shard->users) {
+                f(*p);
+            }
+        }
+    }
+
+    static size_t getConnectionCount();
+
+    // One line of ';' separated values: mean request time in ms, users,
+    // pool heap allocations and acquisitions, frames per write, queued
+    // bytes, window bytes, compression savings, dropped log lines, read
+    // pauses, messages slow subscribers missed, slow subscribers
+    // disconnected, then the latency percentiles of every request type
     static void printStats(std::ostream& os);
 
-    static void handleAccept(Ptr user, const boost::system::error_code& err);
+    // Counters, gauges and latency histograms in the Prometheus text format
+    static void printMetrics(std::ostream& os);
 
     static void startWatcher(std::ostream& os);
     
-    static void startServer();
+    static void startServer(const Config& config);
+
+    // Shards with nothing listening or running on them, startServer adds
+    // its own first. Connections can be started on them without serving.
+    static void addShards(size_t count);
 
     static void stopServer();
-    
-    static io_service& getService();
 
 private:
 
     Server() {
     };
 
-    static io_service service;
-    static deadline_timer serverTimer;
-    static ip::tcp::acceptor acceptor;
-    static boost::thread_group threads;
+    // Connections live on the shard that accepted them and all of their
+    // handlers run on its single thread
+    struct Shard : boost::noncopyable {
+
+        Shard() : service(1), acceptor(service), users(), usersMutex(), timers(TIMER_SLOTS), ticker(service) {
+        }
+
+        io_service service;
+        ip::tcp::acceptor acceptor;
+        SlotMap<Ptr> users;
+        boost::mutex usersMutex;
+        Connection::Timers timers;
+        deadline_timer ticker;
+    };
+
+    enum {
+        // Seconds the wheel covers in one revolution
+        TIMER_SLOTS = 256
+    };
 
-    static UserList users;
-    static boost::recursive_mutex usersMutex;
+    // Advances the shard's timers every second
+    static void startTicker(size_t shard);
+
+    static void listenThread(size_t shard, bool pin);
+
+    static void openAcceptor(Shard& shard, const Config& config);
+
+    static void startAccept(size_t shard);
+
+    static void handleAccept(size_t shard, Ptr user, const boost::system::error_code& err);
+
+    static void startAdminAccept();
+
+    static void handleAdminAccept(AdminSession::Ptr session, const boost::system::error_code& err);
+
+    static std::vector<boost::shared_ptr<Shard> > shards;
+    static boost::scoped_ptr<deadline_timer> serverTimer;
+    // Runs on the first shard, scrapes are rare and short
+    static boost::scoped_ptr<ip::tcp::acceptor> adminAcceptor;
+    static boost::thread_group threads;
 
-    static std::vector<std::string > messages;
-    static boost::recursive_mutex messagesMutex;
+    // Rooms are looked up only on join, leave and room requests, the lock
+    // stays off the send and fetch paths
+    static RoomPtr lobby;
+    static std::unordered_map<std::string, RoomPtr> rooms;
+    static boost::mutex roomsMutex;
+
+    // Under roomsMutex
+    static bool reclaimable(const RoomPtr& room);
+    static size_t windowCount;
+    static size_t windowBytes;
+    static size_t maxRooms;
+    static size_t compressThreshold;
+    static Connection::Limits limits;
+
+    // Only touched on login, logout and stream open
+    static std::unordered_map<std::string, boost::weak_ptr<Connection> > names;
+    static boost::mutex namesMutex;
+    static std::atomic<u_int32_t> streamIds;
 };
 
 
@@ -0,0 +1,115 @@
+/*
+ * File:   SlotMap.hpp
+ * Author: stels
+ *
+ * Created on December 20, 2013, 4:40 PM
+ */
+
+#ifndef SLOTMAP_HPP
+#define	SLOTMAP_HPP
+
+#include <cstdlib>
+#include <sys/types.h>
+#include <utility>
+#include <vector>
+
+// Values kept densely packed for iteration, found by ids that stay valid
+// until the value is erased. Insert and erase are O(1): erase moves the
+// last value into the hole. An id is a slot index and the slot's
+// generation, so an erased id never finds a later value.
+// Not synchronized.
+template <typename T>
+class SlotMap {
+public:
+    typedef u_int64_t Id;
+    // Values can't be changed in place
+    typedef typename std::vector<T>::const_iterator const_iterator;
+    typedef const_iterator iterator;
+
+    SlotMap() : slots(), values(), owners(), freeHead(NONE) {
+    }
+
+    Id insert(const T& value) {
+        u_int32_t index;
+        if (freeHead != NONE) {
+            index = freeHead;
+            freeHead = slots[index].position;
+        } else {
+            index = slots.size();
+            Slot fresh = {0, 0};
+            slots.push_back(fresh);
+        }
+        slots[index].position = values.size();
+        values.push_back(value);
+        owners.push_back(index);
+        return (static_cast<Id> (slots[index].generation) << 32) | index;
+    }
+
+    // false if the id was erased already
+    bool erase(Id id) {
+        u_int32_t index = static_cast<u_int32_t> (id);
+        if (index >= slots.size() || slots[index].generation != static_cast<u_int32_t> (id >> 32)) {
+            return false;
+        }
+        u_int32_t position = slots[index].position;
+        if (position + 1 != values.size()) {
+            std::swap(values[position], values.back());
+            owners[position] = owners.back();
+            slots[owners[position]].position = position;
+        }
+        values.pop_back();
+        owners.pop_back();
+        ++slots[index].generation;
+        slots[index].position = freeHead;
+        freeHead = index;
+        return true;
+    }
+
+    // null if the id was erased
+    const T* find(Id id) const {
+        u_int32_t index = static_cast<u_int32_t> (id);
+        if (index >= slots.size() || slots[index].generation != static_cast<u_int32_t> (id >> 32)) {
+            return nullptr;
+        }
+        return &values[slots[index].position];
+    }
+
+    size_t size() const {
+        return values.size();
+    }
+
+    bool empty() const {
+        return values.empty();
+    }
+
+    // In no particular order, erasing moves values around
+    const_iterator begin() const {
+        return values.begin();
+    }
+
+    const_iterator end() const {
+        return values.end();
+    }
+
+private:
+
+    enum : u_int32_t {
+        NONE = 0xFFFFFFFF
+    };
+
+    // position is the value's index while the slot is used and the next
+    // free slot while it isn't
+    struct Slot {
+        u_int32_t generation;
+        u_int32_t position;
+    };
+
+    std::vector<Slot> slots;
+    std::vector<T> values;
+    // Slot of every value
+    std::vector<u_int32_t> owners;
+    u_int32_t freeHead;
+};
+
+#endif	/* SLOTMAP_HPP */
+
@@ -0,0 +1,88 @@
+/*
+ * File:   TimingWheel.hpp
+ * Author: stels
+ *
+ * Created on December 21, 2013, 11:20 AM
+ */
+
+#ifndef TIMINGWHEEL_HPP
+#define	TIMINGWHEEL_HPP
+
+#include <cstdlib>
+#include <sys/types.h>
+#include <vector>
+
+// Hashed timing wheel: a timer sits in the slot its deadline falls in and
+// every tick sweeps one slot. Timers are never moved when re-armed, the
+// owner just keeps its own deadline; the sweep asks for it and puts the
+// timer in the slot it falls in now. Re-arming is a store, a sweep only
+// looks at the timers due in that slot or a revolution later.
+// Not synchronized, meant for the single thread of one shard.
+template <typename T>
+class TimingWheel {
+public:
+    typedef u_int64_t Tick;
+
+    // slots is rounded up to a power of two, deadlines further out than
+    // that many ticks go round the wheel again
+    explicit TimingWheel(size_t slots) : wheel(roundUp(slots)), mask(wheel.size() - 1), scratch(), now(0) {
+    }
+
+    Tick getNow() const {
+        return now;
+    }
+
+    // deadline is absolute, anything not after now fires on the next tick
+    void schedule(const T& value, Tick deadline) {
+        Timer timer = {value, deadline};
+        wheel[(deadline > now ? deadline : now + 1) & mask].push_back(timer);
+    }
+
+    // Moves on one tick. f(value) is called for every timer that came due
+    // and returns the value's deadline now, a later one keeps the timer and
+    // 0 drops it.
+    template <typename F>
+    void advance(F f) {
+        ++now;
+        scratch.swap(wheel[now & mask]);
+        for (const Timer& timer : scratch) {
+            Tick deadline = timer.deadline > now ? timer.deadline : f(timer.value);
+            if (deadline != 0) {
+                schedule(timer.value, deadline);
+            }
+        }
+        scratch.clear();
+    }
+
+    size_t size() const {
+        size_t total = 0;
+        for (const std::vector<Timer>& slot : wheel) {
+            total += slot.size();
+        }
+        return total;
+    }
+
+private:
+
+    struct Timer {
+        T value;
+        Tick deadline;
+    };
+
+    static size_t roundUp(size_t n) {
+        size_t size = 1;
+        while (size < n) {
+            size <<= 1;
+        }
+        return size;
+    }
+
+    std::vector<std::vector<Timer> > wheel;
+    Tick mask;
+    // The slot being swept, kept to reuse its storage
+    std::vector<Timer> scratch;
+    Tick now;
+};
+
+#endif	/* TIMINGWHEEL_HPP */
+
@@ -0,0 +1,47 @@
+/*
+ * File:   Admin.cpp
+ * Author: stels
+ *
+ * Created on December 18, 2013, 2:30 PM
+ */
+
+#include <sstream>
+
+#include "../include/Admin.hpp"
+#include "../include/Server.hpp"
+
+void AdminSession::start() {
+    Ptr self = shared_from_this();
+    async_read_until(socket_, request, "\r\n\r\n",
+            [this, self](boost::system::error_code ec, std::size_t) {
+                if (ec) {
+                    return;
+                }
+                std::istream is(&request);
+                std::string method, path;
+                is >> method >> path;
+                if (method != "GET") {
+                    reply("405 Method Not Allowed", "");
+                } else if (path != "/metrics" && path != "/") {
+                    reply("404 Not Found", "");
+                } else {
+                    std::ostringstream os;
+                    Server::printMetrics(os);
+                    reply("200 OK", os.str());
+                }
+            });
+}
+
+void AdminSession::reply(const std::string& status, const std::string& body) {
+    std::ostringstream os;
+    os << "HTTP/1.0 " << status << "\r\n"
+            << "Content-Type: text/plain; version=0.0.4\r\n"
+            << "Content-Length: " << body.size() << "\r\n"
+            << "Connection: close\r\n\r\n" << body;
+    response = os.str();
+    Ptr self = shared_from_this();
+    async_write(socket_, buffer(response), [this, self](boost::system::error_code, std::size_t) {
+        boost::system::error_code ec;
+        socket_.shutdown(ip::tcp::socket::shutdown_both, ec);
+    });
+}
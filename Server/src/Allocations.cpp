@@ -0,0 +1,67 @@
+/*
+ * File:   Allocations.cpp
+ * Author: stels
+ *
+ * Created on December 22, 2013, 10:15 AM
+ */
+
+#include <new>
+#include <atomic>
+#include <cstdlib>
+
+#include "../include/Allocations.hpp"
+
+namespace {
+
+enum {
+    SHARDS = 64
+};
+
+// A counter per cache line, threads take one each in turn so the io
+// threads never share one. Nothing here may allocate.
+struct alignas(64) Shard {
+    std::atomic<u_int64_t> count;
+};
+
+Shard shards[SHARDS];
+std::atomic<size_t> nextShard(0);
+
+void countOne() {
+    static thread_local size_t mine = nextShard.fetch_add(1, std::memory_order_relaxed) % SHARDS;
+    shards[mine].count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void* allocate(size_t size) {
+    countOne();
+    void* p = std::malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+}
+
+u_int64_t Allocations::count() {
+    u_int64_t total = 0;
+    for (const Shard& s : shards) {
+        total += s.count.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+void* operator new(size_t size) {
+    return allocate(size);
+}
+
+void* operator new[](size_t size) {
+    return allocate(size);
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    std::free(p);
+}
@@ -1,4 +1,5 @@
 #include "../../Core/Message.hpp"
+#include "../../Core/Compression.hpp"
 #include "../include/Connection.hpp"
 #include "../include/Server.hpp"
 
@@ -13,28 +14,56 @@ const static std::string END_COLOR("\033[0m");
 
 typedef boost::system::error_code ErrorCode;
 
+// The stats' atomics have the connection's thread as their only writer, a
+// relaxed load and store does without a locked add
+template <typename T>
+static void bump(std::atomic<T>& counter, T n) {
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
 void Connection::start() {
     Server::startConnection(shared_from_this());
-    boost::recursive_mutex::scoped_lock lock(userMutex);
     isStarted = true;
-    doReadHeader();
+    // Batches go out as several gathered writes, don't let Nagle hold the tail
+    ErrorCode ec;
+    socket_.set_option(ip::tcp::no_delay(true), ec);
+    const Limits& limits = Server::getLimits();
+    if (limits.idleTimeout > 0 || limits.writeTimeout > 0) {
+        armTimeouts();
+    }
+    doRead();
 }
 
-Connection::Ptr Connection::createNewUser() {
-    Ptr newUser(new Connection);
+Connection::Ptr Connection::createNewUser(io_service& service, size_t shard) {
+    Ptr newUser(new Connection(service, shard));
     return newUser;
 }
 
 void Connection::stop() {
-    {
-        boost::recursive_mutex::scoped_lock lock(userMutex);
-        if (!isStarted) return;
-        isStarted = false;
-        socket_.close();
-    }
-    Server::addMessage(SERVICE_COLOR + BYE_MSG + username + "!" + END_COLOR);
+    if (!isStarted) return;
+    isStarted = false;
+    socket_.close();
     Ptr self = shared_from_this();
     Server::stopConnection(self);
+    Server::removeUser(username, self);
+    std::vector<Membership> left;
+    std::unordered_map<u_int32_t, Stream> open;
+    left.swap(memberships);
+    open.swap(streams);
+    for (Membership& m : left) {
+        m.room->unsubscribe(m.subscription);
+        std::string name = m.room->getName();
+        m.room.reset();
+        Server::releaseRoom(name);
+    }
+    for (const auto& s : open) {
+        Ptr peer = s.second.peer.lock();
+        if (peer) {
+            peer->getService().post(boost::bind(&Connection::closeStream, peer, s.first,
+                    static_cast<u_int32_t> (Message::STREAM_ABORTED)));
+        }
+    }
+    lobby->addMessage(SERVICE_COLOR + BYE_MSG + username + "!" + END_COLOR);
 }
 
 bool Connection::started() const {
@@ -45,95 +74,491 @@ ip::tcp::socket& Connection::sock() {
     return socket_;
 }
 
+io_service& Connection::getService() {
+    return service_;
+}
+
 std::string Connection::getUsername() const {
     return username;
 }
 
-long long Connection::getAllTime() const {
-    boost::recursive_mutex::scoped_lock lock(userMutex);
-    return allTime;
+long long Connection::getWriteCounter() const {
+    return writeCounter.load(std::memory_order_relaxed);
+}
+
+long long Connection::getFrameCounter() const {
+    return frameCounter.load(std::memory_order_relaxed);
 }
 
-long long Connection::getRequestCounter() const {
-    boost::recursive_mutex::scoped_lock lock(userMutex);
-    return requestCounter;
+size_t Connection::getQueuedBytes() const {
+    return queuedBytes.load(std::memory_order_relaxed);
 }
 
-Connection::Connection() : socket_(Server::getService()),
+long long Connection::getCompressedBytes() const {
+    return compressedBytes.load(std::memory_order_relaxed);
+}
+
+long long Connection::getCompressedSaved() const {
+    return compressedSaved.load(std::memory_order_relaxed);
+}
+
+size_t Connection::getShard() const {
+    return shard;
+}
+
+SlotMap<Connection::Ptr>::Id Connection::getId() const {
+    return id;
+}
+
+void Connection::setId(SlotMap<Ptr>::Id registered) {
+    id = registered;
+}
+
+Connection::Connection(io_service& service, size_t shard) : service_(service),
+shard(shard),
+id(0),
+socket_(service),
+inBuffer(IN_BUFFER_SIZE),
+inStart(0),
+inEnd(0),
+batching(false),
+readMsg(),
+corrID(0),
+pendingReplies(0),
+readPaused(false),
 isStarted(false),
 username(),
-handlers({
-    &Connection::onLogin,
-    &Connection::onFetch,
-    &Connection::onSend,
-    &Connection::onLogout
-}),
-allTime(0),
-requestCounter(0) {
-}
-
-void Connection::handleRequest(Message readMsg) {
-    boost::for_each(handlers, [readMsg, this](Handler h){
-        (this ->*h)(readMsg);
-    });
+compression(false),
+writeQueue(),
+writeBatch(),
+writeBuffers(),
+spareOutgoing(),
+readMemory(),
+queuedBytes(0),
+queuedFrames(0),
+writing(false),
+writeCounter(0),
+frameCounter(0),
+compressedBytes(0),
+compressedSaved(0),
+lobby(Server::getLobby()),
+memberships(),
+pushing(false),
+pushHeld(false),
+pushPosted(false),
+streams(),
+timers(nullptr),
+lastRead(0),
+writeStarted(0),
+current(),
+currentType(0) {
+}
+
+const Connection::Handler Connection::HANDLERS[HANDLERS_SIZE] = {
+    &Connection::onLogin, // login_request
+    &Connection::onSend, // send_request
+    &Connection::onFetch, // fetch_request
+    &Connection::onLogout, // logout_request
+    &Connection::onFetchRange, // fetch_range_request
+    &Connection::onSubscribe, // subscribe_request
+    nullptr,
+    &Connection::onJoin, // join_request
+    &Connection::onLeave, // leave_request
+    &Connection::onRoomSend, // room_send_request
+    &Connection::onRoomFetchRange, // room_fetch_range_request
+    &Connection::onHeartbeat, // heartbeat_request
+    &Connection::onSendBatch, // send_batch_request
+    &Connection::onStreamOpen, // stream_open_request
+    &Connection::onStreamChunk, // stream_chunk_request
+    &Connection::onStreamClose // stream_close_request
+};
+
+void Connection::handleRequest(const Message& readMsg) {
+    corrID = readMsg.getCorrID();
+    currentType = readMsg.getMsgType();
+    Counters::request(currentType);
+    size_t slot = currentType / 2;
+    if ((currentType & 1) && slot < HANDLERS_SIZE && HANDLERS[slot]) {
+        (this->*HANDLERS[slot])(readMsg);
+    }
 }
 
 
 // Handlers
 ////////////////////////////////////////////////////////////////////////////////
 
-void Connection::onLogin(Message readMsg) {
-    if (readMsg.getMsgType() != Message::login_request) {
-        return;
-    }
-    std::istringstream iss(std::string(readMsg.getBody(), readMsg.getBodyLength()));
-    {
-        boost::recursive_mutex::scoped_lock lock(userMutex);
-        std::getline(iss, username);
-    }
-    Server::addMessage(SERVICE_COLOR + HELLO_MSG + username + "!" + END_COLOR);
-    std::cout << "Login " << username << std::endl;
+void Connection::onLogin(const Message& readMsg) {
+    boost::string_ref name = Codec::Reader(readMsg.getBodyView()).line();
+    username.assign(name.begin(), name.end());
+    compression = (readMsg.getFlags() & Message::COMPRESSED) && Server::getCompressThreshold() > 0;
+    Server::addUser(username, shared_from_this());
+    lobby->addMessage(SERVICE_COLOR + HELLO_MSG + username + "!" + END_COLOR);
+    Logger::log("Login " + username);
     replyLogin();
 }
 
 void Connection::replyLogin() {
-    Message msg(Message::login_reply);
-    std::ostringstream oss;
-    u_int32_t serverState = Server::getMessagesSize();
-    oss << serverState;
-    msg.fillBody(oss.str());
+    Message msg(Message::login_reply, Message::VERSION, compression ? Message::COMPRESSED : 0);
+    msg.appendU32(lobby->getMessagesSize());
     doWrite(msg);
 }
 
-void Connection::onFetch(Message readMsg) {
-    if (readMsg.getMsgType() != Message::fetch_request) {
-        return;
-    }
-    std::istringstream iss(std::string(readMsg.getBody(), readMsg.getBodyLength()));
-    u_int32_t state;
-    iss >> state;
+void Connection::onFetch(const Message& readMsg) {
+    u_int32_t state = 0;
+    Codec::Reader(readMsg.getBodyView()).u32(state);
     replyFetch(state);
 }
 
 void Connection::replyFetch(u_int32_t state) {
     Message msg(Message::fetch_reply);
-    std::ostringstream oss;
-    if (state < Server::getMessagesSize()) {
-        oss << Server::getMessage(state);
+    if (state < lobby->getMessagesSize()) {
+        Message frame;
+        if (!lobby->getMessage(state, frame)) {
+            size_t first = lobby->getFirstMessage();
+            if (state < first) {
+                // Gone for good, the client resumes at the oldest one left
+                doWrite(truncatedReply(*lobby, first));
+            } else {
+                // Appended but not readable yet, answered like a fetch past
+                // the end so the client polls again later
+                doWrite(msg);
+            }
+            return;
+        }
+        // Own header for the corrID, the body comes from the stored frame
+        msg.setBodyLength(frame.getBodyLength());
+        Outgoing reply = takeOutgoing();
+        reply.add(msg, 0, Message::HEADER_LENGTH);
+        reply.add(frame, Message::HEADER_LENGTH, frame.getBodyLength());
+        doWrite(std::move(reply));
+    } else {
+        doWrite(msg);
     }
-    msg.fillBody(oss.str());
-    doWrite(msg);
     //    std::cout << "reply " << requestCounter << std::endl;
 }
 
-void Connection::onSend(Message readMsg) {
-    if (readMsg.getMsgType() != Message::send_request) {
+void Connection::onFetchRange(const Message& readMsg) {
+    Codec::Reader reader(readMsg.getBodyView());
+    u_int32_t state = 0;
+    u_int32_t maxCount = 0;
+    u_int32_t maxBytes = Message::MAX_LENGTH;
+    reader.u32(state);
+    reader.u32(maxCount);
+    reader.u32(maxBytes);
+    replyFetchRange(*lobby, Message::fetch_range_reply, state, maxCount, maxBytes);
+}
+
+void Connection::replyFetchRange(const Room& room, u_int32_t type, u_int32_t state, u_int32_t maxCount, u_int32_t maxBytes) {
+    size_t next;
+    Outgoing reply = rangeReply(room, type, state, maxCount, maxBytes, next);
+    compress(reply);
+    doWrite(std::move(reply));
+}
+
+bool Connection::compress(Outgoing& out) {
+    size_t bodyLength = out.bytes - Message::HEADER_LENGTH;
+    if (!compression || bodyLength < Server::getCompressThreshold()) {
+        return false;
+    }
+    // Frames are gathered from the log, deflate wants them in one piece
+    const Message& head = out.messages.front();
+    Message flat(head.getMsgType(), head.getvP(), head.getFlags());
+    flat.reserveBody(bodyLength);
+    flat.setBodyLength(bodyLength);
+    char* pos = flat.getBody();
+    for (size_t i = 0; i < out.buffers.size(); ++i) {
+        const char* data = buffer_cast<const char*> (out.buffers[i]);
+        size_t size = buffer_size(out.buffers[i]);
+        if (i == 0) {
+            data += Message::HEADER_LENGTH;
+            size -= Message::HEADER_LENGTH;
+        }
+        std::memcpy(pos, data, size);
+        pos += size;
+    }
+    if (!Compression::compress(flat)) {
+        return false;
+    }
+    Outgoing compressed = takeOutgoing();
+    compressed.reply = out.reply;
+    compressed.add(flat, 0, flat.getDataLength());
+    bump<long long>(compressedBytes, bodyLength);
+    bump<long long>(compressedSaved, bodyLength - flat.getBodyLength());
+    recycle(std::move(out));
+    out = std::move(compressed);
+    return true;
+}
+
+void Connection::compressPush(const Room& room, size_t from, size_t next, Outgoing& out) {
+    size_t bodyLength = out.bytes - Message::HEADER_LENGTH;
+    if (!compression || bodyLength < Server::getCompressThreshold()) {
+        return;
+    }
+    Message flat;
+    if (room.findCompressed(from, next, flat)) {
+        Outgoing compressed = takeOutgoing();
+        compressed.reply = false;
+        compressed.add(flat, 0, flat.getDataLength());
+        bump<long long>(compressedBytes, bodyLength);
+        bump<long long>(compressedSaved, bodyLength - flat.getBodyLength());
+        recycle(std::move(out));
+        out = std::move(compressed);
+    } else if (compress(out)) {
+        room.keepCompressed(from, next, out.messages.front());
+    }
+}
+
+Connection::Outgoing Connection::takeOutgoing() {
+    if (spareOutgoing.empty()) {
+        return Outgoing();
+    }
+    Outgoing out = std::move(spareOutgoing.back());
+    spareOutgoing.pop_back();
+    return out;
+}
+
+void Connection::recycle(Outgoing&& out) {
+    if (spareOutgoing.size() >= MAX_SPARE) {
+        return;
+    }
+    // Lets go of the frames, the capacity stays
+    out.messages.clear();
+    out.buffers.clear();
+    out.bytes = 0;
+    out.reply = true;
+    out.streamed = false;
+    out.stream = 0;
+    spareOutgoing.push_back(std::move(out));
+}
+
+// The state and the room's name, the lobby's is left empty
+static void appendHead(Message& msg, const Room& room, size_t state) {
+    msg.appendU32(state);
+    msg.appendBytes(room.getName() != Server::LOBBY ? boost::string_ref(room.getName()) : boost::string_ref());
+}
+
+Connection::Outgoing Connection::rangeReply(const Room& room, u_int32_t type, u_int32_t state,
+        u_int32_t maxCount, u_int32_t maxBytes, size_t& next) {
+    size_t first = room.getFirstMessage();
+    if (state < first) {
+        next = first;
+        return truncatedReply(room, first);
+    }
+    // Reserve room for the head, the whole body must fit MAX_LENGTH
+    Message head(type);
+    appendHead(head, room, 0);
+    size_t budget = Message::MAX_LENGTH - head.getBodyLength();
+    // Kept per thread, only its capacity outlives the call
+    static thread_local std::vector<Message> frames;
+    frames.clear();
+    next = room.getMessages(state, maxCount, std::min<size_t>(maxBytes, budget), frames);
+    if (frames.size() == 1 && frames.front().getDataLength() > budget) {
+        // Too long for any reply, skip it
+        frames.clear();
+    }
+    Codec::store32(head.getBody(), next);
+    size_t headLength = head.getDataLength();
+    size_t bodyLength = head.getBodyLength();
+    for (const Message& frame : frames) {
+        bodyLength += frame.getDataLength();
+    }
+    head.setBodyLength(bodyLength);
+    Outgoing reply = takeOutgoing();
+    reply.add(head, 0, headLength);
+    for (const Message& frame : frames) {
+        reply.add(frame, 0, frame.getDataLength());
+    }
+    frames.clear();
+    return reply;
+}
+
+Connection::Outgoing Connection::truncatedReply(const Room& room, size_t resumeAt) {
+    Message msg(Message::truncated_reply);
+    appendHead(msg, room, resumeAt);
+    Outgoing reply = takeOutgoing();
+    reply.add(msg, 0, msg.getDataLength());
+    return reply;
+}
+
+void Connection::onSubscribe(const Message& readMsg) {
+    u_int32_t state = 0;
+    Codec::Reader(readMsg.getBodyView()).u32(state);
+    join(lobby, state);
+    replySubscribe();
+    pushMessages();
+}
+
+void Connection::replySubscribe() {
+    Message msg(Message::subscribe_reply);
+    msg.appendU32(lobby->getMessagesSize());
+    doWrite(msg);
+}
+
+void Connection::join(const RoomPtr& room, size_t state) {
+    if (findMembership(*room) == memberships.end()) {
+        // A state past the end, a cursor from before a restart, waits for
+        // the room's next message
+        state = std::min(state, room->getMessagesSize());
+        Membership m = {room, state, false, room->subscribe(shared_from_this())};
+        memberships.push_back(m);
+    }
+}
+
+std::vector<Connection::Membership>::iterator Connection::findMembership(const Room& room) {
+    return std::find_if(memberships.begin(), memberships.end(), [&room](const Membership & m) {
+        return m.room.get() == &room;
+    });
+}
+
+void Connection::onJoin(const Message& readMsg) {
+    Codec::Reader reader(readMsg.getBodyView());
+    u_int32_t state = Message::NO_STATE;
+    reader.u32(state);
+    boost::string_ref name = reader.rest();
+    Message msg(Message::join_reply);
+    RoomPtr room = Server::getRoom(std::string(name.begin(), name.end()));
+    if (room) {
+        size_t size = room->getMessagesSize();
+        join(room, state == Message::NO_STATE ? size : state);
+        msg.appendU32(size);
+    }
+    doWrite(msg);
+    pushMessages();
+}
+
+void Connection::onLeave(const Message& readMsg) {
+    boost::string_ref name = readMsg.getBodyView();
+    auto it = std::find_if(memberships.begin(), memberships.end(), [&name](const Membership & m) {
+        return m.room->getName() == name;
+    });
+    if (it != memberships.end()) {
+        it->room->unsubscribe(it->subscription);
+        std::string left = it->room->getName();
+        memberships.erase(it);
+        Server::releaseRoom(left);
+    }
+    Message msg(Message::leave_reply);
+    doWrite(msg);
+}
+
+void Connection::onRoomSend(const Message& readMsg) {
+    Codec::Reader reader(readMsg.getBodyView());
+    boost::string_ref name = reader.line();
+    boost::string_ref text = reader.line();
+    Message msg(Message::room_send_reply);
+    RoomPtr room;
+    auto it = std::find_if(memberships.begin(), memberships.end(), [&name](const Membership & m) {
+        return m.room->getName() == name;
+    });
+    if (it != memberships.end()) {
+        room = it->room;
+    }
+    if (room) {
+        room->addMessage(USER_NAME_COLOR + username + ": " + END_COLOR + text.to_string());
+    } else {
+        msg.append("Not in ");
+        msg.append(name);
+    }
+    doWrite(msg);
+}
+
+void Connection::onRoomFetchRange(const Message& readMsg) {
+    Codec::Reader reader(readMsg.getBodyView());
+    u_int32_t state = 0;
+    u_int32_t maxCount = 0;
+    u_int32_t maxBytes = Message::MAX_LENGTH;
+    reader.u32(state);
+    reader.u32(maxCount);
+    reader.u32(maxBytes);
+    boost::string_ref name = reader.rest();
+    RoomPtr room = Server::findRoom(name);
+    if (room) {
+        replyFetchRange(*room, Message::room_fetch_range_reply, state, maxCount, maxBytes);
+    } else {
+        // Nothing was ever said there
+        Message msg(Message::room_fetch_range_reply);
+        msg.appendU32(0);
+        msg.appendBytes(name);
+        doWrite(msg);
+    }
+}
+
+bool Connection::claimPush() {
+    return !pushPosted.exchange(true, std::memory_order_acq_rel);
+}
+
+void Connection::pushMessages() {
+    // Cleared before the rooms are looked at, a message appended after this
+    // posts again. The exchange pairs with claimPush's so the room sizes
+    // read below are at least the ones the poster saw.
+    pushPosted.exchange(false, std::memory_order_acq_rel);
+    // One push in flight at a time, whatever arrives meanwhile goes out
+    // with the next batch when it completes. Every room with news gets its
+    // own fetch_range_reply in the batch.
+    if (!isStarted || !checkLag() || pushing) {
+        return;
+    }
+    if (backlogged()) {
+        pushHeld = true;
+        return;
+    }
+    Outgoing push = takeOutgoing();
+    push.reply = false;
+    for (Membership& m : memberships) {
+        if (m.skipped) {
+            Outgoing notice = truncatedReply(*m.room, m.pushState);
+            push.append(notice);
+            recycle(std::move(notice));
+            m.skipped = false;
+        }
+        if (m.pushState < m.room->getMessagesSize()) {
+            size_t next;
+            Outgoing range = rangeReply(*m.room, Message::fetch_range_reply, m.pushState,
+                    Message::MAX_LENGTH, Message::MAX_LENGTH, next);
+            compressPush(*m.room, m.pushState, next, range);
+            push.append(range);
+            recycle(std::move(range));
+            m.pushState = next;
+        }
+    }
+    if (push.messages.empty()) {
+        recycle(std::move(push));
         return;
     }
-    std::istringstream iss(std::string(readMsg.getBody(), readMsg.getBodyLength()));
-    std::string msg;
-    std::getline(iss, msg);
-    Server::addMessage(USER_NAME_COLOR + username + ": " + END_COLOR + msg);
+    pushing = true;
+    doWrite(std::move(push));
+}
+
+bool Connection::checkLag() {
+    const Limits& limits = Server::getLimits();
+    for (Membership& m : memberships) {
+        size_t size = m.room->getMessagesSize();
+        if (m.pushState >= size || size - m.pushState <= limits.maxLag) {
+            continue;
+        }
+        switch (limits.policy) {
+            case DROP:
+                Counters::add(Counters::SLOW_DROPPED, size - m.pushState - limits.maxLag);
+                m.pushState = size > limits.maxLag ? size - limits.maxLag : 0;
+                break;
+            case SKIP:
+                Counters::add(Counters::SLOW_SKIPPED, size - m.pushState);
+                m.pushState = size;
+                m.skipped = true;
+                break;
+            case DISCONNECT:
+                Counters::add(Counters::SLOW_DISCONNECTS, 1);
+                Logger::log("Slow consumer " + username + " disconnected");
+                stop();
+                return false;
+        }
+    }
+    return true;
+}
+
+void Connection::onSend(const Message& readMsg) {
+    boost::string_ref text = Codec::Reader(readMsg.getBodyView()).line();
+    lobby->addMessage(USER_NAME_COLOR + username + ": " + END_COLOR + text.to_string());
     replySend();
 }
 
@@ -142,65 +567,409 @@ void Connection::replySend() {
     doWrite(msg);
 }
 
-void Connection::onLogout(Message readMsg) {
-    if (readMsg.getMsgType() != Message::logout_request) {
+void Connection::onSendBatch(const Message& readMsg) {
+    Codec::Reader reader(readMsg.getBodyView());
+    const std::string prefix = USER_NAME_COLOR + username + ": " + END_COLOR;
+    std::vector<std::string> lines;
+    boost::string_ref text;
+    while (reader.bytes(text)) {
+        lines.push_back(prefix + text.to_string());
+    }
+    size_t first = lines.empty() ? lobby->getMessagesSize() : lobby->addMessages(lines);
+    Message msg(Message::send_batch_reply);
+    msg.appendU32(first);
+    msg.appendU32(lines.size());
+    doWrite(msg);
+}
+
+// Streams
+////////////////////////////////////////////////////////////////////////////////
+// Each end keeps the stream in its own map and only ever touches the other
+// end by posting to its service, the two may be on different shards. Posts
+// between two services run in the order they were made, a close never
+// overtakes the chunks before it.
+
+void Connection::onStreamOpen(const Message& readMsg) {
+    Codec::Reader reader(readMsg.getBodyView());
+    boost::string_ref user;
+    Message msg(Message::stream_open_reply);
+    Ptr peer;
+    if (reader.bytes(user)) {
+        peer = Server::findUser(user);
+    }
+    // The push carries the sender's name, a name leaving no room is refused
+    size_t room = Message::streamDescriptionRoom(username.size());
+    if (peer && peer.get() != this && streams.size() < MAX_STREAMS && room > 0) {
+        u_int32_t id = Server::nextStreamId();
+        Stream s = {peer, true, std::deque<PendingChunk>()};
+        streams[id] = s;
+        boost::string_ref description = reader.rest().substr(0, room);
+        peer->getService().post(boost::bind(&Connection::acceptStream, peer, id, shared_from_this(), username,
+                std::string(description.begin(), description.end())));
+        msg.appendU32(id);
+        msg.appendU32(STREAM_WINDOW);
+    }
+    doWrite(msg);
+}
+
+void Connection::onStreamChunk(const Message& readMsg) {
+    Codec::Reader reader(readMsg.getBodyView());
+    u_int32_t id = 0;
+    reader.u32(id);
+    auto s = streams.find(id);
+    Ptr peer = s != streams.end() && s->second.sending ? s->second.peer.lock() : Ptr();
+    if (peer && s->second.pending.size() >= STREAM_WINDOW) {
+        // Past its window, the sender doesn't wait for its replies
+        peer->getService().post(boost::bind(&Connection::closeStream, peer, id,
+                static_cast<u_int32_t> (Message::STREAM_ABORTED)));
+        answerChunks(id, s->second, Message::STREAM_ABORTED);
+        streams.erase(s);
+        peer.reset();
+    }
+    if (!peer) {
+        Message msg(Message::stream_chunk_reply);
+        msg.appendU32(id);
+        msg.appendU32(Message::STREAM_ABORTED);
+        doWrite(msg);
+        return;
+    }
+    // readMsg is reused for the next request, the chunk gets its own buffer
+    Message chunk(Message::stream_chunk_reply);
+    chunk.append(readMsg.getBodyView());
+    PendingChunk pending = {corrID, current};
+    s->second.pending.push_back(pending);
+    peer->getService().post(boost::bind(&Connection::forwardChunk, peer, id, chunk));
+}
+
+void Connection::onStreamClose(const Message& readMsg) {
+    u_int32_t id = 0;
+    Codec::Reader(readMsg.getBodyView()).u32(id);
+    Message msg(Message::stream_close_reply);
+    msg.appendU32(id);
+    auto s = streams.find(id);
+    if (s == streams.end()) {
+        msg.appendU32(Message::STREAM_ABORTED);
+        doWrite(msg);
+        return;
+    }
+    // Only a sender with every chunk delivered closes cleanly
+    u_int32_t status = s->second.sending && s->second.pending.empty() ? Message::STREAM_OK : Message::STREAM_ABORTED;
+    Ptr peer = s->second.peer.lock();
+    if (peer) {
+        peer->getService().post(boost::bind(&Connection::closeStream, peer, id, status));
+    }
+    answerChunks(id, s->second, Message::STREAM_ABORTED);
+    streams.erase(s);
+    msg.appendU32(Message::STREAM_OK);
+    doWrite(msg);
+}
+
+void Connection::acceptStream(u_int32_t id, const Ptr& sender, const std::string& from, const std::string& description) {
+    if (!isStarted || streams.size() >= MAX_STREAMS) {
+        sender->getService().post(boost::bind(&Connection::closeStream, sender, id,
+                static_cast<u_int32_t> (Message::STREAM_ABORTED)));
         return;
     }
+    Stream s = {sender, false, std::deque<PendingChunk>()};
+    streams[id] = s;
+    Message msg(Message::stream_open_reply);
+    msg.appendU32(id);
+    msg.appendBytes(from);
+    msg.append(description);
+    pushStream(msg);
+}
+
+void Connection::forwardChunk(u_int32_t id, const Message& chunk) {
+    auto s = streams.find(id);
+    if (!isStarted || s == streams.end()) {
+        // Closed meanwhile, the sender was told or is about to be
+        return;
+    }
+    Counters::add(Counters::STREAM_BYTES, chunk.getBodyLength() - sizeof (u_int32_t));
+    pushStream(chunk, id);
+}
+
+void Connection::chunkWritten(u_int32_t id) {
+    auto s = streams.find(id);
+    if (!isStarted || s == streams.end() || s->second.pending.empty()) {
+        return;
+    }
+    PendingChunk pending = s->second.pending.front();
+    s->second.pending.pop_front();
+    answerChunk(id, pending, Message::STREAM_OK);
+}
+
+void Connection::closeStream(u_int32_t id, u_int32_t status) {
+    auto s = streams.find(id);
+    if (!isStarted || s == streams.end()) {
+        return;
+    }
+    answerChunks(id, s->second, Message::STREAM_ABORTED);
+    streams.erase(s);
+    Message msg(Message::stream_close_reply);
+    msg.appendU32(id);
+    msg.appendU32(status);
+    pushStream(msg);
+}
+
+void Connection::answerChunks(u_int32_t id, Stream& stream, u_int32_t status) {
+    for (const PendingChunk& pending : stream.pending) {
+        answerChunk(id, pending, status);
+    }
+    stream.pending.clear();
+}
+
+void Connection::answerChunk(u_int32_t id, const PendingChunk& pending, u_int32_t status) {
+    // Answers the chunk request, not the one being handled if any
+    Message msg(Message::stream_chunk_reply);
+    msg.appendU32(id);
+    msg.appendU32(status);
+    msg.setCorrID(pending.corrID);
+    Outgoing reply = takeOutgoing();
+    reply.add(msg, 0, msg.getDataLength());
+    reply.requestType = Message::stream_chunk_request;
+    reply.started = pending.started;
+    queueWrite(std::move(reply));
+}
+
+void Connection::pushStream(const Message& m, u_int32_t id) {
+    Outgoing push = takeOutgoing();
+    push.reply = false;
+    push.streamed = true;
+    push.stream = id;
+    push.add(m, 0, m.getDataLength());
+    doWrite(std::move(push));
+}
+
+void Connection::onLogout(const Message&) {
     Message msg(Message::logout_reply);
     doWrite(msg);
 }
 
+void Connection::onHeartbeat(const Message&) {
+    Message msg(Message::heartbeat_reply);
+    doWrite(msg);
+}
+
 ///////////////////////////////////////////////////////////////////////////////////////
 
-void Connection::doReadHeader() {
-    //    std::cout << "Read header " << i++ << " " << std::endl;
-    Message readMsg;
-    boost::asio::async_read(socket_,
-            boost::asio::buffer(readMsg.getData(), Message::HEADER_LENGTH),
-            [this, readMsg](boost::system::error_code ec, std::size_t /*length*/) mutable {
-                if (!ec && readMsg.verifyHeader()) {
-                    startRequest();
-                    doReadBody(readMsg);
-                } else {
+void Connection::doRead() {
+    if (inBuffer.size() - inEnd < Message::HEADER_LENGTH + Message::MAX_LENGTH) {
+        std::copy(inBuffer.begin() + inStart, inBuffer.begin() + inEnd, inBuffer.begin());
+        inEnd -= inStart;
+        inStart = 0;
+    }
+    Ptr self = shared_from_this();
+    socket_.async_read_some(boost::asio::buffer(&inBuffer[inEnd], inBuffer.size() - inEnd),
+            makeHandler(readMemory, [this, self](boost::system::error_code ec, std::size_t length) {
+                if (ec) {
                     stop();
+                    return;
                 }
-            });
+                Counters::add(Counters::BYTES_IN, length);
+                if (timers) {
+                    lastRead = timers->getNow();
+                }
+                inEnd += length;
+                processInput();
+            }));
 }
 
-void Connection::doReadBody(Message readMsg) {
-    //    std::cout << "Do read body" << boost::this_thread::get_id() << " " << std::endl;
-    boost::asio::async_read(socket_,
-            boost::asio::buffer(readMsg.getBody(), readMsg.getBodyLength()),
-            [this, readMsg](boost::system::error_code ec, std::size_t /*length*/) {
-                if (!ec) {
-                    handleRequest(readMsg);
-                } else {
-                    stop();
-                }
-            });
+void Connection::processInput() {
+    batching = true;
+    while (isStarted && !backlogged() && inEnd - inStart >= Message::HEADER_LENGTH) {
+        // readMsg is reused for every request, its buffer only ever grows
+        std::memcpy(readMsg.getData(), &inBuffer[inStart], Message::HEADER_LENGTH);
+        if (!readMsg.verifyHeader()) {
+            batching = false;
+            stop();
+            return;
+        }
+        size_t length = Message::HEADER_LENGTH + readMsg.getBodyLength();
+        if (inEnd - inStart < length) {
+            break;
+        }
+        readMsg.reserveBody(readMsg.getBodyLength());
+        std::memcpy(readMsg.getBody(), &inBuffer[inStart + Message::HEADER_LENGTH], readMsg.getBodyLength());
+        inStart += length;
+        startRequest();
+        handleRequest(readMsg);
+    }
+    batching = false;
+    if (!isStarted) {
+        return;
+    }
+    if (!writing && !writeQueue.empty()) {
+        writing = true;
+        startWrite();
+    }
+    if (inStart == inEnd) {
+        inStart = inEnd = 0;
+    }
+    // Too much waiting to be written, resumed by the write handler
+    if (!backlogged()) {
+        doRead();
+    } else {
+        readPaused = true;
+        Counters::add(Counters::READ_PAUSES, 1);
+    }
+}
+
+void Connection::doWrite(Message writeMsg) {
+    Outgoing reply = takeOutgoing();
+    reply.add(writeMsg, 0, writeMsg.getDataLength());
+    doWrite(std::move(reply));
+}
+
+void Connection::doWrite(Outgoing&& out) {
+    if (out.reply) {
+        out.messages.front().setCorrID(corrID);
+        out.started = current;
+        out.requestType = currentType;
+    }
+    queueWrite(std::move(out));
 }
 
-void Connection::doWrite(const Message writeMsg) {
+void Connection::queueWrite(Outgoing&& out) {
+    if (out.reply) {
+        ++pendingReplies;
+    }
+    bump<size_t>(queuedBytes, out.bytes);
+    ++queuedFrames;
+    writeQueue.push_back(std::move(out));
+    if (!writing && !batching) {
+        writing = true;
+        startWrite();
+    }
+}
+
+void Connection::startWrite() {
     //    std::cout << "Do write " << boost::this_thread::get_id() << " " << writeMsg.getvP() << " " << writeMsg.getMsgType() << std::endl;
-    boost::asio::async_write(socket_,
-            boost::asio::buffer(writeMsg.getData(), writeMsg.getDataLength()),
-            [this](boost::system::error_code ec, std::size_t sz/*length*/) {
-                if (!ec) {
-                    completeRequest();
-                    doReadHeader();
-                } else {
+    writeBatch.swap(writeQueue);
+    writeBuffers.clear();
+    for (const Outgoing& out : writeBatch) {
+        writeBuffers.insert(writeBuffers.end(), out.buffers.begin(), out.buffers.end());
+    }
+    // A write taking several sendmsg calls is corked so the kernel doesn't
+    // push out a short segment between them
+    bool cork = writeBuffers.size() > MAX_IOV;
+    if (cork) {
+        setCork(true);
+    }
+    bump<long long>(writeCounter, 1);
+    bump<long long>(frameCounter, writeBatch.size());
+    if (timers) {
+        writeStarted = timers->getNow();
+    }
+    Ptr self = shared_from_this();
+    BufferView view = {writeBuffers.begin(), writeBuffers.end()};
+    boost::asio::async_write(socket_, view,
+            [this, self, cork](boost::system::error_code ec, std::size_t sz) {
+                if (ec) {
                     stop();
+                    return;
+                }
+                Counters::add(Counters::BYTES_OUT, sz);
+                if (cork) {
+                    setCork(false);
+                }
+                bool pushed = false;
+                for (const Outgoing& out : writeBatch) {
+                    if (out.reply) {
+                        completeRequest(out);
+                        --pendingReplies;
+                    } else if (out.streamed) {
+                        if (out.stream != 0) {
+                            auto s = streams.find(out.stream);
+                            Ptr peer = s != streams.end() ? s->second.peer.lock() : Ptr();
+                            if (peer) {
+                                peer->getService().post(boost::bind(&Connection::chunkWritten, peer, out.stream));
+                            }
+                        }
+                    } else {
+                        pushing = false;
+                        pushed = true;
+                    }
+                    bump<size_t>(queuedBytes, -out.bytes);
+                }
+                queuedFrames -= writeBatch.size();
+                for (Outgoing& out : writeBatch) {
+                    recycle(std::move(out));
+                }
+                writeBatch.clear();
+                if (!writeQueue.empty()) {
+                    startWrite();
+                } else {
+                    writing = false;
+                }
+                if (readPaused && drained()) {
+                    readPaused = false;
+                    processInput();
+                }
+                if (pushed || pushHeld) {
+                    pushHeld = false;
+                    pushMessages();
                 }
             });
 }
 
+void Connection::setCork(bool on) {
+#ifdef TCP_CORK
+    typedef boost::asio::detail::socket_option::boolean<IPPROTO_TCP, TCP_CORK> cork;
+    ErrorCode ec;
+    socket_.set_option(cork(on), ec);
+#endif
+}
+
+bool Connection::backlogged() const {
+    const Limits& limits = Server::getLimits();
+    return pendingReplies >= MAX_PIPELINE || queuedBytes.load(std::memory_order_relaxed) >= limits.highWater
+            || queuedFrames >= limits.maxFrames;
+}
+
+bool Connection::drained() const {
+    const Limits& limits = Server::getLimits();
+    return pendingReplies < MAX_PIPELINE && queuedBytes.load(std::memory_order_relaxed) <= limits.lowWater
+            && queuedFrames < limits.maxFrames;
+}
+
+void Connection::armTimeouts() {
+    if (!isStarted) {
+        return;
+    }
+    timers = &Server::getTimers(shard);
+    lastRead = writeStarted = timers->getNow();
+    timers->schedule(shared_from_this(), checkTimeouts(lastRead));
+}
+
+Connection::Timers::Tick Connection::checkTimeouts(Timers::Tick now) {
+    const static Timers::Tick NEVER = ~Timers::Tick(0);
+    if (!isStarted) {
+        return 0;
+    }
+    const Limits& limits = Server::getLimits();
+    // Ticks are whole seconds, a tick more makes sure the full timeout passed
+    Timers::Tick idleDue = limits.idleTimeout > 0 ? lastRead + limits.idleTimeout + 1 : NEVER;
+    Timers::Tick writeDue = limits.writeTimeout > 0 && writing ? writeStarted + limits.writeTimeout + 1 : NEVER;
+    if (idleDue <= now || writeDue <= now) {
+        bool idle = idleDue <= now;
+        Counters::add(idle ? Counters::IDLE_TIMEOUTS : Counters::WRITE_TIMEOUTS, 1);
+        Logger::log((idle ? "Idle timeout " : "Write timeout ") + username);
+        stop();
+        return 0;
+    }
+    // A write may start any time, look again by when it would be late
+    if (limits.writeTimeout > 0 && !writing) {
+        writeDue = now + limits.writeTimeout + 1;
+    }
+    return std::min(idleDue, writeDue);
+}
+
 void Connection::startRequest() {
-    boost::recursive_mutex::scoped_lock lock(userMutex);
-    current = boost::posix_time::microsec_clock::local_time();
+    current = std::chrono::steady_clock::now();
 }
 
-void Connection::completeRequest() {
-    boost::recursive_mutex::scoped_lock lock(userMutex);
-    allTime += (boost::posix_time::microsec_clock::local_time() - current).total_milliseconds();
-    ++requestCounter;
+void Connection::completeRequest(const Outgoing& reply) {
+    std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - reply.started;
+    Latency::record(reply.requestType, elapsed.count());
 }
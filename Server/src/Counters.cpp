@@ -0,0 +1,41 @@
+/*
+ * File:   Counters.cpp
+ * Author: stels
+ *
+ * Created on December 18, 2013, 1:10 PM
+ */
+
+#include "../include/Counters.hpp"
+
+u_int64_t Counters::get(Counter counter) {
+    u_int64_t total = 0;
+    boost::mutex::scoped_lock lock(shardsMutex);
+    for (Shard* s : shards) {
+        total += s->counters[counter].load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+u_int64_t Counters::getRequests(u_int32_t requestType) {
+    u_int64_t total = 0;
+    if ((requestType >> 1) < TYPES) {
+        boost::mutex::scoped_lock lock(shardsMutex);
+        for (Shard* s : shards) {
+            total += s->requests[requestType >> 1].load(std::memory_order_relaxed);
+        }
+    }
+    return total;
+}
+
+Counters::Shard& Counters::shard() {
+    static thread_local Shard* mine = nullptr;
+    if (mine == nullptr) {
+        mine = new Shard;
+        boost::mutex::scoped_lock lock(shardsMutex);
+        shards.push_back(mine);
+    }
+    return *mine;
+}
+
+std::vector<Counters::Shard*> Counters::shards;
+boost::mutex Counters::shardsMutex;
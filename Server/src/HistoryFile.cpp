@@ -0,0 +1,230 @@
+/*
+ * File:   HistoryFile.cpp
+ * Author: stels
+ *
+ * Created on December 9, 2013, 4:37 PM
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+
+#include "../include/HistoryFile.hpp"
+
+namespace {
+
+const char MAGIC[8] = {'C', 'H', 'A', 'T', 'H', 'I', 'S', 'T'};
+
+int openFile(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("Can't open " + path + ": " + std::strerror(errno));
+    }
+    return fd;
+}
+
+u_int64_t fileSize(int fd) {
+    struct stat st;
+    if (::fstat(fd, &st) < 0) {
+        throw std::runtime_error(std::string("Can't stat history: ") + std::strerror(errno));
+    }
+    return st.st_size;
+}
+
+void resize(int fd, u_int64_t size) {
+    if (::ftruncate(fd, size) < 0) {
+        throw std::runtime_error(std::string("Can't resize history: ") + std::strerror(errno));
+    }
+}
+
+}
+
+const u_int64_t HistoryFile::MAX_LOG_BYTES;
+const u_int64_t HistoryFile::MAX_INDEX_BYTES;
+const u_int64_t HistoryFile::GROW_BYTES;
+
+HistoryFile::HistoryFile(const std::string& path, const Config& config) : config(config),
+logFd(openFile(path + ".log")), indexFd(openFile(path + ".idx")),
+log(mapFile(logFd, MAX_LOG_BYTES)), index(mapFile(indexFd, MAX_INDEX_BYTES)),
+logSize(fileSize(logFd)), indexSize(fileSize(indexFd)), tail(0), unsynced(0), recoveredCount(0) {
+    if (indexSize.load() < sizeof (Header)) {
+        ensureSize(indexFd, indexSize, sizeof (Header), MAX_INDEX_BYTES);
+        std::memcpy(header().magic, MAGIC, sizeof (MAGIC));
+        header().version = FORMAT_VERSION;
+        header().count = 0;
+        header().tail = 0;
+    } else if (std::memcmp(header().magic, MAGIC, sizeof (MAGIC)) != 0 || header().version != FORMAT_VERSION) {
+        throw std::runtime_error(path + ".idx is not a history index");
+    }
+    recover();
+    if (config.checkpointMillis > 0) {
+        flusher = boost::thread(boost::bind(&HistoryFile::flusherThread, this));
+    }
+}
+
+HistoryFile::~HistoryFile() {
+    flusher.interrupt();
+    if (flusher.joinable()) {
+        flusher.join();
+    }
+    checkpoint();
+    ::munmap(log, MAX_LOG_BYTES);
+    ::munmap(index, MAX_INDEX_BYTES);
+    ::close(logFd);
+    ::close(indexFd);
+}
+
+char* HistoryFile::mapFile(int fd, u_int64_t reserve) {
+    void* p = ::mmap(nullptr, reserve, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+    if (p == MAP_FAILED) {
+        throw std::runtime_error(std::string("Can't map history: ") + std::strerror(errno));
+    }
+    return static_cast<char*> (p);
+}
+
+void HistoryFile::recover() {
+    // Entries past the checkpoint may have been written, or half written,
+    // before a crash. Keep the complete prefix.
+    u_int64_t count = header().count;
+    u_int64_t end = header().tail;
+    while (sizeof (Header) + (count + 1) * sizeof (Entry) <= indexSize.load() && validEntry(count, logSize.load())) {
+        end = std::max<u_int64_t>(end, entry(count).offset + entry(count).length);
+        ++count;
+    }
+    // Truncating and growing back zeroes whatever lies past the prefix, so
+    // stale entries can't be picked up by the next recovery
+    u_int64_t oldIndexSize = indexSize.load();
+    resize(indexFd, sizeof (Header) + count * sizeof (Entry));
+    resize(indexFd, oldIndexSize);
+    u_int64_t oldLogSize = logSize.load();
+    resize(logFd, end);
+    resize(logFd, oldLogSize);
+
+    header().count = count;
+    header().tail = end;
+    tail.store(end);
+    recoveredCount = count;
+}
+
+bool HistoryFile::validEntry(size_t i, u_int64_t size) const {
+    u_int64_t offset = entry(i).offset.load(std::memory_order_relaxed);
+    u_int64_t length = entry(i).length.load(std::memory_order_acquire);
+    if (length < Message::HEADER_LENGTH || length > Message::HEADER_LENGTH + Message::MAX_LENGTH
+            || offset > size || size - offset < length) {
+        return false;
+    }
+    const char* pos = log + offset;
+    const char* end = pos + length;
+    u_int32_t type, bodyLength;
+    const char* body;
+    return Message::nextFrame(pos, end, type, body, bodyLength) && pos == end && type == Message::fetch_reply;
+}
+
+void HistoryFile::ensureSize(int fd, std::atomic<u_int64_t>& size, u_int64_t needed, u_int64_t reserve) {
+    if (needed <= size.load(std::memory_order_acquire)) {
+        return;
+    }
+    boost::mutex::scoped_lock lock(growMutex);
+    if (needed <= size.load(std::memory_order_acquire)) {
+        return;
+    }
+    if (needed > reserve) {
+        throw std::length_error("HistoryFile is full");
+    }
+    u_int64_t grown = std::min(reserve, (needed + GROW_BYTES - 1) / GROW_BYTES * GROW_BYTES);
+    resize(fd, grown);
+    size.store(grown, std::memory_order_release);
+}
+
+void HistoryFile::append(size_t i, const Message& frame) {
+    u_int64_t length = frame.getDataLength();
+    u_int64_t offset = tail.fetch_add(length, std::memory_order_relaxed);
+    ensureSize(logFd, logSize, offset + length, MAX_LOG_BYTES);
+    ensureSize(indexFd, indexSize, sizeof (Header) + (i + 1) * sizeof (Entry), MAX_INDEX_BYTES);
+    write(i, frame, offset);
+    appended(1);
+}
+
+void HistoryFile::appendBatch(size_t first, const std::vector<Message>& frames) {
+    u_int64_t total = 0;
+    for (const Message& frame : frames) {
+        total += frame.getDataLength();
+    }
+    u_int64_t offset = tail.fetch_add(total, std::memory_order_relaxed);
+    ensureSize(logFd, logSize, offset + total, MAX_LOG_BYTES);
+    ensureSize(indexFd, indexSize, sizeof (Header) + (first + frames.size()) * sizeof (Entry), MAX_INDEX_BYTES);
+    for (size_t i = 0; i < frames.size(); ++i) {
+        write(first + i, frames[i], offset);
+        offset += frames[i].getDataLength();
+    }
+    appended(frames.size());
+}
+
+void HistoryFile::write(size_t i, const Message& frame, u_int64_t offset) {
+    u_int64_t length = frame.getDataLength();
+    std::memcpy(log + offset, frame.getData(), length);
+    entry(i).offset.store(offset, std::memory_order_relaxed);
+    entry(i).length.store(length, std::memory_order_release);
+}
+
+void HistoryFile::appended(size_t count) {
+    if (config.syncEvery > 0 && unsynced.fetch_add(count, std::memory_order_relaxed) + count >= config.syncEvery) {
+        unsynced.store(0, std::memory_order_relaxed);
+        ::fdatasync(logFd);
+        ::fdatasync(indexFd);
+    }
+}
+
+bool HistoryFile::get(size_t i, Message& out) const {
+    if (sizeof (Header) + (i + 1) * sizeof (Entry) > indexSize.load(std::memory_order_acquire)) {
+        return false;
+    }
+    u_int64_t length = entry(i).length.load(std::memory_order_acquire);
+    if (length == 0) {
+        return false;
+    }
+    u_int64_t offset = entry(i).offset.load(std::memory_order_relaxed);
+    Message frame;
+    frame.reserveBody(length - Message::HEADER_LENGTH);
+    std::memcpy(frame.getData(), log + offset, length);
+    out = frame;
+    return true;
+}
+
+void HistoryFile::checkpoint() {
+    boost::mutex::scoped_lock lock(checkpointMutex);
+    u_int64_t count = header().count;
+    u_int64_t end = header().tail;
+    while (sizeof (Header) + (count + 1) * sizeof (Entry) <= indexSize.load(std::memory_order_acquire)) {
+        u_int64_t length = entry(count).length.load(std::memory_order_acquire);
+        if (length == 0) {
+            break;
+        }
+        end = std::max<u_int64_t>(end, entry(count).offset.load(std::memory_order_relaxed) + length);
+        ++count;
+    }
+    if (count == header().count) {
+        return;
+    }
+    // Entries must be on disk before the checkpoint that covers them
+    ::fdatasync(logFd);
+    ::fdatasync(indexFd);
+    header().count = count;
+    header().tail = end;
+    ::msync(index, sizeof (Header), MS_SYNC);
+}
+
+void HistoryFile::flusherThread() {
+    try {
+        while (true) {
+            boost::this_thread::sleep(boost::posix_time::millisec(config.checkpointMillis));
+            checkpoint();
+        }
+    } catch (boost::thread_interrupted&) {
+    }
+}
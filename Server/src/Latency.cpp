@@ -0,0 +1,49 @@
+/*
+ * File:   Latency.cpp
+ * Author: stels
+ *
+ * Created on December 17, 2013, 3:40 PM
+ */
+
+#include "../include/Latency.hpp"
+
+void Latency::record(u_int32_t requestType, u_int64_t nanos) {
+    if ((requestType >> 1) < TYPES) {
+        shard().histograms[requestType >> 1].record(nanos);
+    }
+}
+
+Histogram Latency::snapshot(u_int32_t requestType) {
+    Histogram merged;
+    if ((requestType >> 1) < TYPES) {
+        boost::mutex::scoped_lock lock(shardsMutex);
+        for (Shard* s : shards) {
+            merged.add(s->histograms[requestType >> 1]);
+        }
+    }
+    return merged;
+}
+
+Histogram Latency::snapshot() {
+    Histogram merged;
+    boost::mutex::scoped_lock lock(shardsMutex);
+    for (Shard* s : shards) {
+        for (size_t i = 0; i < TYPES; ++i) {
+            merged.add(s->histograms[i]);
+        }
+    }
+    return merged;
+}
+
+Latency::Shard& Latency::shard() {
+    static thread_local Shard* mine = nullptr;
+    if (mine == nullptr) {
+        mine = new Shard;
+        boost::mutex::scoped_lock lock(shardsMutex);
+        shards.push_back(mine);
+    }
+    return *mine;
+}
+
+std::vector<Latency::Shard*> Latency::shards;
+boost::mutex Latency::shardsMutex;
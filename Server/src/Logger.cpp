@@ -0,0 +1,121 @@
+/*
+ * File:   Logger.cpp
+ * Author: stels
+ *
+ * Created on December 16, 2013, 11:20 AM
+ */
+
+#include "../include/Logger.hpp"
+
+void Logger::start(const Config& c, std::ostream& os) {
+    config = c;
+    out = &os;
+    size_t capacity = 2;
+    while (capacity < config.capacity) {
+        capacity *= 2;
+    }
+    ring.reset(new Slot[capacity]);
+    for (size_t i = 0; i < capacity; ++i) {
+        ring[i].seq.store(i, std::memory_order_relaxed);
+    }
+    mask = capacity - 1;
+    running.store(true);
+    writer = boost::thread(writerThread);
+}
+
+void Logger::stop() {
+    if (!ring) {
+        return;
+    }
+    running.store(false);
+    writer.join();
+}
+
+void Logger::log(std::string line) {
+    if (!running.load(std::memory_order_relaxed)) {
+        *out << line << std::endl;
+        return;
+    }
+    size_t pos = tail.load(std::memory_order_relaxed);
+    while (true) {
+        Slot& slot = ring[pos & mask];
+        size_t seq = slot.seq.load(std::memory_order_acquire);
+        if (seq == pos) {
+            if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                slot.line.swap(line);
+                slot.seq.store(pos + 1, std::memory_order_release);
+                return;
+            }
+        } else if (seq < pos) {
+            // Full, the writer hasn't taken the line a lap behind yet
+            if (config.policy == DROP) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            boost::this_thread::yield();
+            pos = tail.load(std::memory_order_relaxed);
+        } else {
+            pos = tail.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+size_t Logger::getDropped() {
+    return dropped.load(std::memory_order_relaxed);
+}
+
+size_t Logger::getQueued() {
+    if (!ring) {
+        return 0;
+    }
+    size_t h = head.load(std::memory_order_relaxed);
+    size_t t = tail.load(std::memory_order_relaxed);
+    return t > h ? t - h : 0;
+}
+
+bool Logger::pop(std::string& line) {
+    size_t h = head.load(std::memory_order_relaxed);
+    Slot& slot = ring[h & mask];
+    if (slot.seq.load(std::memory_order_acquire) != h + 1) {
+        return false;
+    }
+    line.swap(slot.line);
+    slot.line.clear();
+    slot.seq.store(h + mask + 1, std::memory_order_release);
+    head.store(h + 1, std::memory_order_relaxed);
+    return true;
+}
+
+void Logger::writerThread() {
+    std::string batch;
+    std::string line;
+    while (true) {
+        size_t count = 0;
+        while (count < BATCH && pop(line)) {
+            batch += line;
+            batch += '\n';
+            ++count;
+        }
+        if (count > 0) {
+            out->write(batch.data(), batch.size());
+            out->flush();
+            batch.clear();
+            continue;
+        }
+        // Queue drained, lines logged before stop are all out
+        if (!running.load()) {
+            break;
+        }
+        boost::this_thread::sleep(boost::posix_time::millisec(1));
+    }
+}
+
+Logger::Config Logger::config;
+std::ostream* Logger::out = &std::cout;
+std::unique_ptr<Logger::Slot[]> Logger::ring;
+size_t Logger::mask = 0;
+std::atomic<size_t> Logger::tail(0);
+std::atomic<size_t> Logger::head(0);
+std::atomic<bool> Logger::running(false);
+std::atomic<size_t> Logger::dropped(0);
+boost::thread Logger::writer;
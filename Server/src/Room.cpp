@@ -0,0 +1,190 @@
+/*
+ * File:   Room.cpp
+ * Author: stels
+ *
+ * Created on December 11, 2013, 2:15 PM
+ */
+
+#include <algorithm>
+
+#include "../include/Room.hpp"
+#include "../include/Connection.hpp"
+#include "../include/Server.hpp"
+
+const static size_t MAX_NAME_LENGTH = 64;
+const static size_t NO_END = ~size_t(0);
+
+Room::Room(const std::string& name, size_t windowCount, size_t windowBytes, HistoryFile* history) : name(name),
+messages(windowCount / MessageLog<Message>::SEGMENT_SIZE + 2),
+history(history),
+historyBase(history ? history->recovered() : 0),
+historyEnd(NO_END),
+windowCount(windowCount),
+windowBytes(windowBytes),
+subscribers(),
+subscribersMutex(),
+compressedFrom(0),
+compressedNext(0),
+compressedFrame(),
+compressedMutex() {
+}
+
+void Room::addMessage(const std::string& msg) {
+    Message frame(Message::fetch_reply);
+    frame.fillBody(msg);
+    size_t seq = messages.append(frame, frame.getDataLength());
+    if (persisting()) {
+        try {
+            history->append(historyBase + seq, frame);
+        } catch (const std::exception& e) {
+            stopPersisting(historyBase + seq, e);
+        }
+    }
+    messages.trim(windowCount, windowBytes);
+    Server::print(name, msg);
+    notifySubscribers();
+}
+
+size_t Room::addMessages(const std::vector<std::string>& msgs) {
+    std::vector<Message> frames(msgs.size());
+    for (size_t i = 0; i < msgs.size(); ++i) {
+        frames[i] = Message(Message::fetch_reply);
+        frames[i].fillBody(msgs[i]);
+    }
+    size_t seq = messages.appendBatch(frames, [](const Message & frame) {
+        return frame.getDataLength();
+    });
+    if (persisting() && !frames.empty()) {
+        try {
+            history->appendBatch(historyBase + seq, frames);
+        } catch (const std::exception& e) {
+            stopPersisting(historyBase + seq, e);
+        }
+    }
+    messages.trim(windowCount, windowBytes);
+    for (const std::string& msg : msgs) {
+        Server::print(name, msg);
+    }
+    if (!frames.empty()) {
+        notifySubscribers();
+    }
+    return historyBase + seq;
+}
+
+void Room::notifySubscribers() {
+    // Subscribers with a push already posted pick this message up with it.
+    // Posting happens outside the lock, joins and leaves don't wait on it.
+    std::vector<Ptr> targets;
+    {
+        boost::mutex::scoped_lock lock(subscribersMutex);
+        for (const Ptr& p : subscribers) {
+            if (p->claimPush()) {
+                targets.push_back(p);
+            }
+        }
+    }
+    for (const Ptr& p : targets) {
+        p->getService().post(boost::bind(&Connection::pushMessages, p));
+    }
+}
+
+bool Room::getMessage(size_t index, Message& out) const {
+    if (index >= historyBase && messages.get(index - historyBase, out)) {
+        return true;
+    }
+    return history && index < historyEnd.load(std::memory_order_acquire) && history->get(index, out);
+}
+
+size_t Room::getMessages(size_t from, size_t maxCount, size_t maxBytes, std::vector<Message>& out) const {
+    size_t size = getMessagesSize();
+    size_t bytes = 0;
+    for (; from < size && out.size() < maxCount; ++from) {
+        Message frame;
+        if (!getMessage(from, frame)) {
+            break;
+        }
+        // The first message is always taken so the reader makes progress
+        if (!out.empty() && bytes + frame.getDataLength() > maxBytes) {
+            break;
+        }
+        bytes += frame.getDataLength();
+        out.push_back(frame);
+    }
+    return from;
+}
+
+size_t Room::getMessagesSize() const {
+    return historyBase + messages.size();
+}
+
+size_t Room::getFirstMessage() const {
+    if (!history) {
+        return messages.first();
+    }
+    // Everything before historyEnd is on file, the rest only while the
+    // window still reaches back to it
+    size_t first = historyBase + messages.first();
+    size_t end = historyEnd.load(std::memory_order_acquire);
+    return end == NO_END || first <= end ? 0 : first;
+}
+
+size_t Room::getWindowBytes() const {
+    return messages.bytes();
+}
+
+bool Room::persisting() const {
+    return history && historyEnd.load(std::memory_order_acquire) == NO_END;
+}
+
+void Room::stopPersisting(size_t index, const std::exception& e) {
+    size_t end = historyEnd.load(std::memory_order_acquire);
+    while (index < end) {
+        if (historyEnd.compare_exchange_weak(end, index, std::memory_order_acq_rel)) {
+            // Logged once, by whoever stopped it
+            if (end == NO_END) {
+                Logger::log("History of " + name + " stopped at message " + std::to_string(index) + ": "
+                        + e.what() + ", keeping messages in memory only");
+            }
+            return;
+        }
+    }
+}
+
+void Room::sync() {
+    if (history) {
+        history->checkpoint();
+    }
+}
+
+SlotMap<Room::Ptr>::Id Room::subscribe(const Ptr& p) {
+    boost::mutex::scoped_lock lock(subscribersMutex);
+    return subscribers.insert(p);
+}
+
+void Room::unsubscribe(SlotMap<Ptr>::Id id) {
+    boost::mutex::scoped_lock lock(subscribersMutex);
+    subscribers.erase(id);
+}
+
+bool Room::findCompressed(size_t from, size_t next, Message& out) const {
+    boost::mutex::scoped_lock lock(compressedMutex);
+    if (compressedNext == 0 || compressedFrom != from || compressedNext != next) {
+        return false;
+    }
+    out = compressedFrame;
+    return true;
+}
+
+void Room::keepCompressed(size_t from, size_t next, const Message& frame) const {
+    boost::mutex::scoped_lock lock(compressedMutex);
+    compressedFrom = from;
+    compressedNext = next;
+    compressedFrame = frame;
+}
+
+bool Room::validName(boost::string_ref name) {
+    return !name.empty() && name.size() <= MAX_NAME_LENGTH
+            && std::find_if(name.begin(), name.end(), [](char c) {
+                return c <= ' ' || c == 127;
+            }) == name.end();
+}
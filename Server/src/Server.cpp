@@ -5,89 +5,394 @@
  * Created on November 14, 2013, 9:56 PM
  */
 
+#include <pthread.h>
+#include <sched.h>
+
 #include "../../Core/Message.hpp"
 #include "../include/Connection.hpp"
 #include "../include/Server.hpp"
 
-io_service& Server::getService() {
-    return service;
-}
-
 void Server::stopServer() {
-    service.stop();
-    UserList copy;
-    {
-        boost::recursive_mutex::scoped_lock lock(usersMutex);
-        copy = users;
+    boost::for_each(shards, [](const boost::shared_ptr<Shard> & shard) {
+        shard->service.stop();
+    });
+    threads.join_all();
+    // stop unregisters, so the connections are taken out first
+    std::vector<Ptr> left;
+    for (const boost::shared_ptr<Shard>& shard : shards) {
+        boost::mutex::scoped_lock lock(shard->usersMutex);
+        left.insert(left.end(), shard->users.begin(), shard->users.end());
     }
-    boost::for_each(copy, [](const Ptr & p) {
+    boost::for_each(left, [](const Ptr & p) {
         p -> stop();
     });
+    lobby->sync();
+    Logger::stop();
+}
+
+const Server::RoomPtr& Server::getLobby() {
+    return lobby;
+}
+
+Server::RoomPtr Server::getRoom(const std::string& name) {
+    if (name == LOBBY) {
+        return lobby;
+    }
+    if (!Room::validName(name)) {
+        return RoomPtr();
+    }
+    boost::mutex::scoped_lock lock(roomsMutex);
+    auto it = rooms.find(name);
+    if (it != rooms.end()) {
+        return it->second;
+    }
+    if (rooms.size() >= maxRooms) {
+        // Rooms left behind empty are only swept when they're in the way
+        for (auto r = rooms.begin(); r != rooms.end();) {
+            r = reclaimable(r->second) ? rooms.erase(r) : std::next(r);
+        }
+        if (rooms.size() >= maxRooms) {
+            Counters::add(Counters::ROOMS_REFUSED, 1);
+            return RoomPtr();
+        }
+    }
+    RoomPtr room = boost::make_shared<Room>(name, windowCount, windowBytes);
+    rooms[name] = room;
+    return room;
+}
+
+void Server::releaseRoom(const std::string& name) {
+    boost::mutex::scoped_lock lock(roomsMutex);
+    auto it = rooms.find(name);
+    if (it != rooms.end() && reclaimable(it->second)) {
+        rooms.erase(it);
+    }
+}
+
+bool Server::reclaimable(const RoomPtr& room) {
+    // New references are only handed out under the lock, one held by the
+    // map alone stays that way
+    return room.unique() && room->getMessagesSize() == 0;
 }
 
-void Server::addMessage(const std::string& msg) {
-    boost::recursive_mutex::scoped_lock lock(messagesMutex);
-    messages.push_back(std::string(msg));
-    std::cout << msg << std::endl;
+Server::RoomPtr Server::findRoom(boost::string_ref name) {
+    if (name == LOBBY) {
+        return lobby;
+    }
+    boost::mutex::scoped_lock lock(roomsMutex);
+    auto it = rooms.find(std::string(name.begin(), name.end()));
+    return it == rooms.end() ? RoomPtr() : it->second;
+}
+
+void Server::print(const std::string& room, const std::string& msg) {
+    Logger::log(room == LOBBY ? msg : "[" + room + "] " + msg);
+}
+
+size_t Server::getCompressThreshold() {
+    return compressThreshold;
 }
 
-std::string Server::getMessage(size_t index) {
-    std::string msg;
-    boost::recursive_mutex::scoped_lock lock(messagesMutex);
-    msg = messages[index];
-    return std::move(msg);
+const Connection::Limits& Server::getLimits() {
+    return limits;
 }
 
-size_t Server::getMessagesSize() {
-    size_t size;
-    boost::recursive_mutex::scoped_lock lock(messagesMutex);
-    size = messages.size();
-    return size;
+Connection::Timers& Server::getTimers(size_t shard) {
+    return shards[shard]->timers;
 }
 
 void Server::startConnection(const Ptr& p) {
-    boost::recursive_mutex::scoped_lock lock(usersMutex);
-    users.push_back(p);
+    Shard& shard = *shards[p->getShard()];
+    boost::mutex::scoped_lock lock(shard.usersMutex);
+    p->setId(shard.users.insert(p));
 }
 
 void Server::stopConnection(const Ptr& p) {
-    boost::recursive_mutex::scoped_lock lock(usersMutex);
-    auto it = std::find(users.begin(), users.end(), p);
-    users.erase(it);
-    //            std::cout << "stop " << username << std::endl;
+    Shard& shard = *shards[p->getShard()];
+    boost::mutex::scoped_lock lock(shard.usersMutex);
+    shard.users.erase(p->getId());
+}
+
+void Server::addUser(const std::string& name, const Ptr& p) {
+    boost::mutex::scoped_lock lock(namesMutex);
+    names[name] = p;
+}
+
+void Server::removeUser(const std::string& name, const Ptr& p) {
+    boost::mutex::scoped_lock lock(namesMutex);
+    auto it = names.find(name);
+    if (it != names.end() && it->second.lock() == p) {
+        names.erase(it);
+    }
+}
+
+Server::Ptr Server::findUser(boost::string_ref name) {
+    boost::mutex::scoped_lock lock(namesMutex);
+    auto it = names.find(std::string(name.begin(), name.end()));
+    return it == names.end() ? Ptr() : it->second.lock();
+}
+
+u_int32_t Server::nextStreamId() {
+    // 0 is never an id
+    u_int32_t id = streamIds.fetch_add(1, std::memory_order_relaxed) + 1;
+    return id != 0 ? id : nextStreamId();
+}
+
+size_t Server::getConnectionCount() {
+    size_t count = 0;
+    for (const boost::shared_ptr<Shard>& shard : shards) {
+        boost::mutex::scoped_lock lock(shard->usersMutex);
+        count += shard->users.size();
+    }
+    return count;
 }
 
 void Server::printStats(std::ostream& os) {
-    UserList copy;
+    size_t count = 0;
+    double writes = 0;
+    double frames = 0;
+    long long queued = 0;
+    double compressed = 0;
+    double saved = 0;
+    forEachConnection([&](const Connection & c) {
+        ++count;
+        writes += c.getWriteCounter();
+        frames += c.getFrameCounter();
+        queued += c.getQueuedBytes();
+        compressed += c.getCompressedBytes();
+        saved += c.getCompressedSaved();
+    });
+    size_t windowed = lobby->getWindowBytes();
+    {
+        boost::mutex::scoped_lock lock(roomsMutex);
+        for (const auto& room : rooms) {
+            windowed += room.second->getWindowBytes();
+        }
+    }
+    Histogram all = Latency::snapshot();
+    if(all.count() > 1) {
+        // Pool heap allocations stay flat once every connection has its buffers
+        os << all.mean() / 1e6 << ";" << count << ";" << BufferPool::getHeapAllocations()
+                << ";" << BufferPool::getAcquisitions()
+                << ";" << (writes > 0 ? frames / writes : 0) << ";" << queued
+                << ";" << windowed << ";" << (compressed > 0 ? saved / compressed : 0)
+                << ";" << Logger::getDropped() << ";" << Counters::get(Counters::READ_PAUSES)
+                << ";" << Counters::get(Counters::SLOW_DROPPED) + Counters::get(Counters::SLOW_SKIPPED)
+                << ";" << Counters::get(Counters::SLOW_DISCONNECTS);
+        // p50;p90;p99;p999;max in microseconds for each type in turn
+        const static u_int32_t REPORTED[] = {Message::login_request, Message::send_request,
+            Message::fetch_request, Message::fetch_range_request, Message::subscribe_request,
+            Message::logout_request};
+        for (u_int32_t type : REPORTED) {
+            Histogram h = Latency::snapshot(type);
+            os << ";" << h.percentile(0.5) / 1000 << ";" << h.percentile(0.9) / 1000
+                    << ";" << h.percentile(0.99) / 1000 << ";" << h.percentile(0.999) / 1000
+                    << ";" << h.getMax() / 1000;
+        }
+        os << std::endl;
+    }
+}
+
+// Room names may hold any printable character, label values quote them
+static std::string label(const std::string& value) {
+    std::string quoted;
+    for (char c : value) {
+        if (c == '\\' || c == '"') {
+            quoted += '\\';
+        }
+        quoted += c;
+    }
+    return quoted;
+}
+
+void Server::printMetrics(std::ostream& os) {
+    size_t count = 0;
+    size_t queued = 0;
+    size_t maxQueued = 0;
+    forEachConnection([&](const Connection & c) {
+        size_t q = c.getQueuedBytes();
+        ++count;
+        queued += q;
+        maxQueued = std::max(maxQueued, q);
+    });
+    std::vector<RoomPtr> all(1, lobby);
     {
-        boost::recursive_mutex::scoped_lock lock(usersMutex);
-        copy = users;
+        boost::mutex::scoped_lock lock(roomsMutex);
+        for (const auto& room : rooms) {
+            all.push_back(room.second);
+        }
+    }
+    os << "# HELP chat_connections Connections currently open.\n"
+            << "# TYPE chat_connections gauge\n"
+            << "chat_connections " << count << "\n"
+            << "# HELP chat_accepts_total Connections accepted.\n"
+            << "# TYPE chat_accepts_total counter\n"
+            << "chat_accepts_total " << Counters::get(Counters::ACCEPTS) << "\n"
+            << "# HELP chat_received_bytes_total Bytes read from clients.\n"
+            << "# TYPE chat_received_bytes_total counter\n"
+            << "chat_received_bytes_total " << Counters::get(Counters::BYTES_IN) << "\n"
+            << "# HELP chat_sent_bytes_total Bytes written to clients.\n"
+            << "# TYPE chat_sent_bytes_total counter\n"
+            << "chat_sent_bytes_total " << Counters::get(Counters::BYTES_OUT) << "\n"
+            << "# HELP chat_write_queue_bytes Bytes queued for writing over all connections.\n"
+            << "# TYPE chat_write_queue_bytes gauge\n"
+            << "chat_write_queue_bytes " << queued << "\n"
+            << "# HELP chat_write_queue_max_bytes Bytes queued for writing on the most backed up connection.\n"
+            << "# TYPE chat_write_queue_max_bytes gauge\n"
+            << "chat_write_queue_max_bytes " << maxQueued << "\n"
+            << "# HELP chat_read_pauses_total Times reading stopped on a full write queue.\n"
+            << "# TYPE chat_read_pauses_total counter\n"
+            << "chat_read_pauses_total " << Counters::get(Counters::READ_PAUSES) << "\n"
+            << "# HELP chat_slow_consumer_messages_total Messages slow subscribers were never pushed.\n"
+            << "# TYPE chat_slow_consumer_messages_total counter\n"
+            << "chat_slow_consumer_messages_total{policy=\"drop\"} " << Counters::get(Counters::SLOW_DROPPED) << "\n"
+            << "chat_slow_consumer_messages_total{policy=\"skip\"} " << Counters::get(Counters::SLOW_SKIPPED) << "\n"
+            << "# HELP chat_slow_consumer_disconnects_total Subscribers disconnected for falling behind.\n"
+            << "# TYPE chat_slow_consumer_disconnects_total counter\n"
+            << "chat_slow_consumer_disconnects_total " << Counters::get(Counters::SLOW_DISCONNECTS) << "\n"
+            << "# HELP chat_timeouts_total Connections closed for going quiet or not taking writes.\n"
+            << "# TYPE chat_timeouts_total counter\n"
+            << "chat_timeouts_total{kind=\"idle\"} " << Counters::get(Counters::IDLE_TIMEOUTS) << "\n"
+            << "chat_timeouts_total{kind=\"write\"} " << Counters::get(Counters::WRITE_TIMEOUTS) << "\n"
+            << "# HELP chat_stream_bytes_total Stream chunk bytes forwarded to receivers.\n"
+            << "# TYPE chat_stream_bytes_total counter\n"
+            << "chat_stream_bytes_total " << Counters::get(Counters::STREAM_BYTES) << "\n"
+            << "# HELP chat_rooms Rooms besides the lobby.\n"
+            << "# TYPE chat_rooms gauge\n"
+            << "chat_rooms " << all.size() - 1 << "\n"
+            << "# HELP chat_rooms_refused_total Joins refused with every room taken.\n"
+            << "# TYPE chat_rooms_refused_total counter\n"
+            << "chat_rooms_refused_total " << Counters::get(Counters::ROOMS_REFUSED) << "\n"
+            << "# HELP chat_log_queue_lines Console lines waiting for the logger thread.\n"
+            << "# TYPE chat_log_queue_lines gauge\n"
+            << "chat_log_queue_lines " << Logger::getQueued() << "\n"
+            << "# HELP chat_log_dropped_total Console lines dropped on a full logger queue.\n"
+            << "# TYPE chat_log_dropped_total counter\n"
+            << "chat_log_dropped_total " << Logger::getDropped() << "\n"
+            << "# HELP chat_buffer_heap_allocations_total Message buffers taken from the heap.\n"
+            << "# TYPE chat_buffer_heap_allocations_total counter\n"
+            << "chat_buffer_heap_allocations_total " << BufferPool::getHeapAllocations() << "\n"
+            << "# HELP chat_heap_allocations_total Every operator new in the process, buffers or not.\n"
+            << "# TYPE chat_heap_allocations_total counter\n"
+            << "chat_heap_allocations_total " << Allocations::count() << "\n";
+
+    os << "# HELP chat_history_messages Messages sent to the room, including those out of the window.\n"
+            << "# TYPE chat_history_messages gauge\n";
+    for (const RoomPtr& room : all) {
+        os << "chat_history_messages{room=\"" << label(room->getName()) << "\"} "
+                << room->getMessagesSize() << "\n";
+    }
+    os << "# HELP chat_history_first_message Oldest message a fetch can still get.\n"
+            << "# TYPE chat_history_first_message gauge\n";
+    for (const RoomPtr& room : all) {
+        os << "chat_history_first_message{room=\"" << label(room->getName()) << "\"} "
+                << room->getFirstMessage() << "\n";
+    }
+    os << "# HELP chat_history_window_bytes Bytes held by the room's in-memory window.\n"
+            << "# TYPE chat_history_window_bytes gauge\n";
+    for (const RoomPtr& room : all) {
+        os << "chat_history_window_bytes{room=\"" << label(room->getName()) << "\"} "
+                << room->getWindowBytes() << "\n";
     }
-    auto ptr2Time = [](const Ptr & p) {
-        return p -> getAllTime();
+
+    const static std::pair<u_int32_t, const char*> TYPES[] = {
+        {Message::login_request, "login"}, {Message::send_request, "send"},
+        {Message::fetch_request, "fetch"}, {Message::logout_request, "logout"},
+        {Message::fetch_range_request, "fetch_range"}, {Message::subscribe_request, "subscribe"},
+        {Message::join_request, "join"}, {Message::leave_request, "leave"},
+        {Message::room_send_request, "room_send"}, {Message::room_fetch_range_request, "room_fetch_range"},
+        {Message::heartbeat_request, "heartbeat"}, {Message::send_batch_request, "send_batch"},
+        {Message::stream_open_request, "stream_open"}, {Message::stream_chunk_request, "stream_chunk"},
+        {Message::stream_close_request, "stream_close"}
     };
-    double time = boost::accumulate(copy
-            | boost::adaptors::transformed(boost::bind<long long>(ptr2Time, _1)), 0);
-    auto ptr2ReqNum = [](const Ptr & p) {
-        return p -> getRequestCounter();
+    os << "# HELP chat_requests_total Requests read by type.\n"
+            << "# TYPE chat_requests_total counter\n";
+    for (const auto& type : TYPES) {
+        os << "chat_requests_total{type=\"" << type.second << "\"} "
+                << Counters::getRequests(type.first) << "\n";
+    }
+    // Fixed bounds so every scrape has the same buckets, each counts the
+    // histogram buckets lying wholly below it
+    const static double BOUNDS[] = {
+        25e-6, 50e-6, 100e-6, 250e-6, 500e-6, 1e-3, 2.5e-3, 5e-3, 10e-3, 25e-3, 50e-3,
+        100e-3, 250e-3, 500e-3, 1, 2.5, 5, 10
     };
-    double num = boost::accumulate(copy
-            | boost::adaptors::transformed(boost::bind<long long>(ptr2ReqNum, _1)), 0);
-    if(num > 1) {
-        os << time / num << ";" << copy.size() << std::endl;
+    os << "# HELP chat_request_duration_seconds Time from reading a request to writing its reply.\n"
+            << "# TYPE chat_request_duration_seconds histogram\n";
+    for (const auto& type : TYPES) {
+        Histogram h = Latency::snapshot(type.first);
+        size_t bucket = 0;
+        u_int64_t cumulative = 0;
+        for (double bound : BOUNDS) {
+            u_int64_t nanos = static_cast<u_int64_t> (bound * 1e9);
+            for (; bucket < Histogram::BUCKETS && Histogram::bucketLimit(bucket) <= nanos; ++bucket) {
+                cumulative += h.bucketCount(bucket);
+            }
+            os << "chat_request_duration_seconds_bucket{type=\"" << type.second
+                    << "\",le=\"" << bound << "\"} " << cumulative << "\n";
+        }
+        os << "chat_request_duration_seconds_bucket{type=\"" << type.second << "\",le=\"+Inf\"} "
+                << h.count() << "\n"
+                << "chat_request_duration_seconds_sum{type=\"" << type.second << "\"} "
+                << h.getSum() / 1e9 << "\n"
+                << "chat_request_duration_seconds_count{type=\"" << type.second << "\"} "
+                << h.count() << "\n";
     }
 }
 
-void Server::handleAccept(Ptr user, const boost::system::error_code& err) {
-    user->start();
-    Connection::Ptr newUser = Connection::createNewUser();
+void Server::startAccept(size_t shard) {
+#ifdef SO_REUSEPORT
+    size_t target = shard;
+#else
+    // Only the first shard listens and hands connections out round robin
+    static size_t next = 0;
+    size_t target = next++ % shards.size();
+#endif
+    Connection::Ptr newUser = Connection::createNewUser(shards[target]->service, target);
+    shards[shard]->acceptor.async_accept(newUser->sock(), boost::bind(handleAccept, shard, newUser, _1));
+}
+
+void Server::handleAccept(size_t shard, Ptr user, const boost::system::error_code& err) {
+    if (!err) {
+        Counters::add(Counters::ACCEPTS, 1);
+        // Accepted on this shard's thread, the connection may belong to another
+        user->getService().post(boost::bind(&Connection::start, user));
+    }
     //std::cout << "Accepted" << std::endl;
-    acceptor.async_accept(newUser->sock(), boost::bind(handleAccept, newUser, _1));
+    startAccept(shard);
+}
+
+void Server::startAdminAccept() {
+    AdminSession::Ptr session = AdminSession::create(shards.front()->service);
+    adminAcceptor->async_accept(session->sock(), boost::bind(handleAdminAccept, session, _1));
+}
+
+void Server::handleAdminAccept(AdminSession::Ptr session, const boost::system::error_code& err) {
+    if (!err) {
+        session->start();
+    }
+    startAdminAccept();
+}
+
+void Server::startTicker(size_t shard) {
+    Shard& s = *shards[shard];
+    s.ticker.expires_at(s.ticker.expires_at() + boost::posix_time::seconds(1));
+    s.ticker.async_wait([shard](const boost::system::error_code & ec) {
+        if (ec) {
+            return;
+        }
+        Shard& s = *shards[shard];
+        Connection::Timers::Tick now = s.timers.getNow() + 1;
+        s.timers.advance([now](const boost::weak_ptr<Connection>& c) {
+            Ptr p = c.lock();
+            return p ? p->checkTimeouts(now) : 0;
+        });
+        startTicker(shard);
+    });
 }
 
 void Server::startWatcher(std::ostream& os) {
-    serverTimer.expires_from_now(boost::posix_time::millisec(3000));
-    serverTimer.async_wait([&](const boost::system::error_code & ec) {
+    serverTimer->expires_from_now(boost::posix_time::millisec(3000));
+    serverTimer->async_wait([&](const boost::system::error_code & ec) {
         if (!ec) {
             printStats(os);
             startWatcher(os);
@@ -95,28 +400,91 @@ void Server::startWatcher(std::ostream& os) {
     });
 }
 
-void Server::startServer() {
-    Connection::Ptr user = Connection::createNewUser();
-    acceptor.async_accept(user -> sock(), boost::bind(handleAccept, user, _1));
-    for(int i = 0; i < THREADS_NUM; ++i) {
-        threads.create_thread(listenThread);
+void Server::startServer(const Config& config) {
+    windowCount = config.windowCount;
+    windowBytes = config.windowBytes;
+    maxRooms = config.maxRooms;
+    compressThreshold = config.compressThreshold;
+    limits = config.limits;
+    Logger::start(config.log);
+    HistoryFile* history = nullptr;
+    if (!config.historyPath.empty()) {
+        history = new HistoryFile(config.historyPath, config.history);
+    }
+    lobby = boost::make_shared<Room>(LOBBY, windowCount, windowBytes, history);
+    size_t shardsNum = std::max<size_t>(config.threads, 1);
+    addShards(shardsNum);
+#ifdef SO_REUSEPORT
+    for (size_t i = 0; i < shardsNum; ++i) {
+        openAcceptor(*shards[i], config);
+        startAccept(i);
+    }
+#else
+    openAcceptor(*shards.front(), config);
+    startAccept(0);
+#endif
+    for (size_t i = 0; i < shardsNum; ++i) {
+        shards[i]->ticker.expires_from_now(boost::posix_time::seconds(0));
+        startTicker(i);
+    }
+    serverTimer.reset(new deadline_timer(shards.front()->service));
+    if (config.adminPort != 0) {
+        ip::tcp::endpoint endpoint(ip::address_v4::loopback(), config.adminPort);
+        adminAcceptor.reset(new ip::tcp::acceptor(shards.front()->service, endpoint));
+        startAdminAccept();
+    }
+    for (size_t i = 0; i < shardsNum; ++i) {
+        threads.create_thread(boost::bind(listenThread, i, config.pinThreads));
+    }
+}
+
+void Server::addShards(size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        shards.push_back(boost::make_shared<Shard>());
     }
 }
 
-void Server::listenThread() {
-    service.run();
+void Server::openAcceptor(Shard& shard, const Config& config) {
+    ip::tcp::endpoint endpoint(ip::tcp::v4(), config.port);
+    shard.acceptor.open(endpoint.protocol());
+    shard.acceptor.set_option(ip::tcp::acceptor::reuse_address(true));
+#ifdef SO_REUSEPORT
+    // Every shard listens on the same port, the kernel spreads connections
+    typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
+    shard.acceptor.set_option(reuse_port(true));
+#endif
+    shard.acceptor.bind(endpoint);
+    shard.acceptor.listen();
+}
+
+void Server::listenThread(size_t shard, bool pin) {
+    if (pin) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(shard % std::max(boost::thread::hardware_concurrency(), 1u), &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof (cpus), &cpus);
+    }
+    shards[shard]->service.run();
 }
 
-io_service Server::service;
-deadline_timer Server::serverTimer(Server::service);
-ip::tcp::acceptor Server::acceptor(Server::service, ip::tcp::endpoint(ip::tcp::v4(), 33333));
+std::vector<boost::shared_ptr<Server::Shard> > Server::shards;
+boost::scoped_ptr<deadline_timer> Server::serverTimer;
+boost::scoped_ptr<ip::tcp::acceptor> Server::adminAcceptor;
 boost::thread_group Server::threads;
 
-Server::UserList Server::users;
-boost::recursive_mutex Server::usersMutex;
 
-std::vector<std::string > Server::messages;
-boost::recursive_mutex Server::messagesMutex;
+const std::string Server::LOBBY("lobby");
+Server::RoomPtr Server::lobby;
+std::unordered_map<std::string, Server::RoomPtr> Server::rooms;
+boost::mutex Server::roomsMutex;
+size_t Server::windowCount = 0;
+size_t Server::windowBytes = 0;
+size_t Server::maxRooms = 0;
+size_t Server::compressThreshold = 0;
+Connection::Limits Server::limits;
+std::unordered_map<std::string, boost::weak_ptr<Connection> > Server::names;
+boost::mutex Server::namesMutex;
+std::atomic<u_int32_t> Server::streamIds(0);
 
 //////////////////////////////////////////////////////////////////////////////////
 
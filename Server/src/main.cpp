@@ -6,15 +6,85 @@
  */
 
 #include <iostream>
+#include <cstdlib>
+#include <cstring>
 
 #include "../include/Connection.hpp"
 #include "../include/Server.hpp"
 
 
+static void usage(const char* name) {
+    std::cerr << "Usage: " << name << " [--threads N] [--port P] [--no-pin]"
+            << " [--history PATH | --no-history] [--sync-every N] [--checkpoint-ms N]"
+            << " [--window-count N] [--window-bytes N] [--max-rooms N]"
+            << " [--compress-threshold N]"
+            << " [--log-capacity N] [--log-policy drop|block]"
+            << " [--admin-port P]"
+            << " [--high-water BYTES] [--low-water BYTES] [--max-frames N]"
+            << " [--max-lag N] [--slow-policy drop|skip|disconnect]"
+            << " [--idle-timeout S] [--write-timeout S]" << std::endl;
+}
+
 int main(int argc, char** argv) {
+    Server::Config config;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            config.threads = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            config.port = static_cast<unsigned short> (std::strtoul(argv[++i], nullptr, 10));
+        } else if (std::strcmp(argv[i], "--no-pin") == 0) {
+            config.pinThreads = false;
+        } else if (std::strcmp(argv[i], "--history") == 0 && i + 1 < argc) {
+            config.historyPath = argv[++i];
+        } else if (std::strcmp(argv[i], "--no-history") == 0) {
+            config.historyPath.clear();
+        } else if (std::strcmp(argv[i], "--sync-every") == 0 && i + 1 < argc) {
+            config.history.syncEvery = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--checkpoint-ms") == 0 && i + 1 < argc) {
+            config.history.checkpointMillis = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--window-count") == 0 && i + 1 < argc) {
+            config.windowCount = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--window-bytes") == 0 && i + 1 < argc) {
+            config.windowBytes = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--max-rooms") == 0 && i + 1 < argc) {
+            config.maxRooms = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--compress-threshold") == 0 && i + 1 < argc) {
+            config.compressThreshold = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--log-capacity") == 0 && i + 1 < argc) {
+            config.log.capacity = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--log-policy") == 0 && i + 1 < argc) {
+            config.log.policy = std::strcmp(argv[++i], "block") == 0 ? Logger::BLOCK : Logger::DROP;
+        } else if (std::strcmp(argv[i], "--admin-port") == 0 && i + 1 < argc) {
+            config.adminPort = static_cast<unsigned short> (std::strtoul(argv[++i], nullptr, 10));
+        } else if (std::strcmp(argv[i], "--high-water") == 0 && i + 1 < argc) {
+            config.limits.highWater = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--low-water") == 0 && i + 1 < argc) {
+            config.limits.lowWater = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--max-frames") == 0 && i + 1 < argc) {
+            config.limits.maxFrames = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--max-lag") == 0 && i + 1 < argc) {
+            config.limits.maxLag = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--slow-policy") == 0 && i + 1 < argc) {
+            ++i;
+            if (std::strcmp(argv[i], "drop") == 0) {
+                config.limits.policy = Connection::DROP;
+            } else if (std::strcmp(argv[i], "disconnect") == 0) {
+                config.limits.policy = Connection::DISCONNECT;
+            } else {
+                config.limits.policy = Connection::SKIP;
+            }
+        } else if (std::strcmp(argv[i], "--idle-timeout") == 0 && i + 1 < argc) {
+            config.limits.idleTimeout = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--write-timeout") == 0 && i + 1 < argc) {
+            config.limits.writeTimeout = std::strtoul(argv[++i], nullptr, 10);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
     std::ofstream os("log.txt", std::ofstream::out);
+    Server::startServer(config);
     Server::startWatcher(os);
-    Server::startServer();
     while(true) {
         std::string msg;
         std::cin >> msg;